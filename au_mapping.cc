@@ -0,0 +1,256 @@
+// Action Unit から表情モーフへの変換規則
+
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "MMDFileIOUtil.h"
+#include "VMD.h"
+#include "au_mapping.h"
+
+using namespace Eigen;
+using namespace MMDFileIOUtil;
+using namespace std;
+
+// 設定ファイルを指定しなかった場合の変換規則(auconf.txtと同じ内容)
+static const char* default_auconf =
+  u8"あ,26:2.0\n"
+  u8"い,25:2.0\n"
+  u8"う,23:2.0\n"
+  u8"にやり,12:1.0\n"
+  u8"∧,15:1.0\n"
+  u8"まばたき,7:1.0\n"
+  u8"CheekRaiser,6:1.0\n"
+  u8"びっくり,5:1.0\n"
+  u8"困る,1:1.0\n"
+  u8"真面目,2:1.0\n"
+  u8"怒り,9:1.0\n"
+  u8"下,4:1.0\n"
+  u8"上,5:1.0\n"
+  u8"@gate,い,あ,0.1\n"
+  u8"@gate,い,う,0.1\n"
+  u8"@set,まばたき,45,0.2,1.0\n";
+
+// モーフ名に対応する列番号を返す。見つからなければ-1を返す
+static int find_morph(const AUMapping& mapping, const string& name)
+{
+  for (unsigned int i = 0; i < mapping.morph_names.size(); i++) {
+    if (mapping.morph_names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// 変換規則をストリームから読み込む
+static AUMapping parse_au_mapping(istream& conf, int au_size)
+{
+  AUMapping mapping;
+  vector<vector<string>> rules;
+  vector<vector<pair<int, float>>> gains;
+
+  for (string line; getline(conf, line); ) {
+    boost::algorithm::trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    vector<string> fields;
+    boost::algorithm::split(fields, line, boost::is_any_of(","));
+    for (string& s : fields) {
+      boost::algorithm::trim(s);
+    }
+    if (fields[0][0] == '@') {
+      // 規則は全てのモーフを読み終えてから解釈する
+      rules.push_back(fields);
+      continue;
+    }
+    int idx = find_morph(mapping, fields[0]);
+    if (idx < 0) {
+      idx = mapping.morph_names.size();
+      mapping.morph_names.push_back(fields[0]);
+      gains.push_back(vector<pair<int, float>>());
+    }
+    for (unsigned int i = 1; i < fields.size(); i++) {
+      size_t sep = fields[i].find(':');
+      int au = atoi(fields[i].substr(0, sep).c_str());
+      float g = (sep == string::npos) ? 1.0 : atof(fields[i].substr(sep + 1).c_str());
+      if (au <= 0 || au >= au_size) {
+        cerr << "auconf: invalid AU number: " << line << endl;
+        continue;
+      }
+      gains[idx].push_back(make_pair(au, g));
+    }
+  }
+
+  int morph_size = mapping.morph_names.size();
+  mapping.gain = MatrixXf::Zero(au_size, morph_size);
+  for (int j = 0; j < morph_size; j++) {
+    for (auto& p : gains[j]) {
+      mapping.gain(p.first, j) += p.second;
+    }
+  }
+  mapping.lower = VectorXf::Zero(morph_size);
+  mapping.upper = VectorXf::Ones(morph_size);
+
+  for (vector<string>& r : rules) {
+    int target = (r.size() > 1) ? find_morph(mapping, r[1]) : -1;
+    if (target < 0) {
+      cerr << "auconf: unknown morph in rule: " << boost::algorithm::join(r, ",") << endl;
+      continue;
+    }
+    if (r[0] == "@gate" && r.size() == 4) {
+      AUGateRule g;
+      g.target = target;
+      g.source = find_morph(mapping, r[2]);
+      g.threshold = atof(r[3].c_str());
+      if (g.source < 0) {
+        cerr << "auconf: unknown morph in rule: " << boost::algorithm::join(r, ",") << endl;
+        continue;
+      }
+      mapping.gates.push_back(g);
+    } else if (r[0] == "@set" && r.size() == 5) {
+      AUSetRule s;
+      s.target = target;
+      s.au = atoi(r[2].c_str());
+      s.threshold = atof(r[3].c_str());
+      s.value = atof(r[4].c_str());
+      if (s.au <= 0 || s.au >= au_size) {
+        cerr << "auconf: invalid AU number: " << boost::algorithm::join(r, ",") << endl;
+        continue;
+      }
+      mapping.sets.push_back(s);
+    } else if (r[0] == "@clamp" && r.size() == 4) {
+      mapping.lower[target] = atof(r[2].c_str());
+      mapping.upper[target] = atof(r[3].c_str());
+    } else {
+      cerr << "auconf: invalid rule: " << boost::algorithm::join(r, ",") << endl;
+    }
+  }
+  return mapping;
+}
+
+// 設定ファイルfname_confから変換規則を作ってmappingに入れる。fname_confが空の場合は組み込みの規則を使う
+bool make_au_mapping(const string& fname_conf, int au_size, AUMapping& mapping)
+{
+  if (fname_conf.length() == 0) {
+    istringstream conf(default_auconf);
+    mapping = parse_au_mapping(conf, au_size);
+    return true;
+  }
+  ifstream conf(fname_conf);
+  if (!conf) {
+    cerr << "auconf: cannot open " << fname_conf << endl;
+    return false;
+  }
+  mapping = parse_au_mapping(conf, au_size);
+  return true;
+}
+
+// フレーム数×AU数の行列auをまとめて変換し、フレーム数×モーフ数の行列を返す
+MatrixXf eval_au_mapping(const AUMapping& mapping, const Ref<const AUMatrix>& au)
+{
+  // AUの線形結合
+  MatrixXf morph = au * mapping.gain;
+
+  // gate規則の条件は、他のgate規則を適用する前の値で判定する
+  if (!mapping.gates.empty()) {
+    MatrixXf raw = morph;
+    for (const AUGateRule& g : mapping.gates) {
+      morph.col(g.target) = (raw.col(g.source).array() < g.threshold).select(morph.col(g.target), 0.0f);
+    }
+  }
+  for (const AUSetRule& s : mapping.sets) {
+    morph.col(s.target) = (au.col(s.au).array() > s.threshold).select(s.value, morph.col(s.target));
+  }
+  for (int j = 0; j < morph.cols(); j++) {
+    morph.col(j) = morph.col(j).cwiseMax(mapping.lower[j]).cwiseMin(mapping.upper[j]);
+  }
+  return morph;
+}
+
+// eval_au_mappingの結果をモーフごとにキーフレーム列としてmorph_vecに追加する
+void add_morph_tracks(vector<VMD_Morph>& morph_vec, const AUMapping& mapping, const MatrixXf& morph,
+                      const vector<uint32_t>& frame_numbers, const string& skip_name)
+{
+  morph_vec.reserve(morph_vec.size() + morph.size());
+  for (int j = 0; j < morph.cols(); j++) {
+    if (mapping.morph_names[j] == skip_name) {
+      continue;
+    }
+    // モーフ名の変換はモーフごとに1回だけ行う
+    VMD_Morph m;
+    utf8_to_sjis(mapping.morph_names[j], m.name, m.name_len);
+    for (int i = 0; i < morph.rows(); i++) {
+      m.frame = frame_numbers[i];
+      m.weight = morph(i, j);
+      morph_vec.push_back(m);
+    }
+  }
+}
+
+// 平滑化する前のAction Unitの値xから、閉じて開く動きを取り出す
+vector<BlinkEvent> detect_blink_events(const VectorXf& x, const vector<uint32_t>& frame_numbers,
+                                       float close_threshold, float open_threshold)
+{
+  vector<BlinkEvent> events;
+  int n = frame_numbers.size();
+  for (int i = 0; i < n; i++) {
+    if (x[i] < close_threshold) {
+      continue;
+    }
+    // first～lastが閉じているフレーム(途中で顔を見失ったらそこで開いたものとする)
+    int first = i;
+    int last = i;
+    while (last + 1 < n && frame_numbers[last + 1] == frame_numbers[last] + 1 && x[last + 1] >= open_threshold) {
+      last++;
+    }
+    BlinkEvent e;
+    e.closed = frame_numbers[first];
+    e.onset = (e.closed > 0) ? e.closed - 1 : e.closed;
+    e.release = frame_numbers[last];
+    e.open = e.release + 1;
+    events.push_back(e);
+    i = last;
+  }
+  return events;
+}
+
+// eventsを、モーフnameの 0→1→1→0 のキーフレームとしてmorph_vecに追加する
+void add_blink_keys(vector<VMD_Morph>& morph_vec, const string& name, const vector<BlinkEvent>& events,
+                    float srcfps, float tgtfps)
+{
+  // 閉じ始めは切り捨て、開き終わりは切り上げて、フレームレートを下げても閉じる前と開いた後のキーフレームを残す
+  auto convert = [&](uint32_t frame, double round) { return uint32_t(floor(double(frame) * tgtfps / srcfps + round)); };
+  VMD_Morph m;
+  utf8_to_sjis(name, m.name, m.name_len);
+  size_t head = morph_vec.size();
+  auto add = [&](uint32_t frame, float weight) {
+    m.frame = frame;
+    m.weight = weight;
+    morph_vec.push_back(m);
+  };
+  for (const BlinkEvent& e : events) {
+    uint32_t onset = convert(e.onset, 0.0);
+    uint32_t closed = convert(e.closed, 0.5);
+    uint32_t release = convert(e.release, 0.5);
+    uint32_t open = convert(e.open, 1.0 - 1.0e-6);
+    if (morph_vec.size() > head && onset <= morph_vec.back().frame) {
+      // 前のイベントが開き終わる前に閉じ始めるときは、前のイベントの開き終わりを除いてつなげる
+      morph_vec.pop_back();
+    } else if (onset < closed) {
+      add(onset, 0.0);
+    }
+    if (morph_vec.size() == head || closed > morph_vec.back().frame) {
+      add(closed, 1.0);
+    }
+    if (release > morph_vec.back().frame) {
+      add(release, 1.0);
+    }
+    add(max(open, morph_vec.back().frame + 1), 0.0);
+  }
+}
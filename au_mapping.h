@@ -0,0 +1,72 @@
+// -*- C++ -*-
+// Action Unit から表情モーフへの変換規則
+
+#ifndef AU_MAPPING_H
+#define AU_MAPPING_H
+
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "VMD.h"
+
+// 条件モーフの値が閾値以上のフレームでは、対象モーフを0にする
+struct AUGateRule {
+  int target;      // 対象モーフの列番号
+  int source;      // 条件モーフの列番号
+  float threshold;
+};
+
+// Action Unitの値が閾値を超えたフレームでは、対象モーフを固定値にする
+struct AUSetRule {
+  int target;      // 対象モーフの列番号
+  int au;          // Action Unit ID
+  float threshold;
+  float value;
+};
+
+// AU→モーフ変換規則
+// モーフの値 = AUの線形結合 → gate規則 → set規則 → 上下限で切り詰め の順に求める
+struct AUMapping {
+  std::vector<std::string> morph_names; // 列番号に対応するモーフ名
+  MatrixXf gain;                        // AU数×モーフ数の係数行列
+  std::vector<AUGateRule> gates;
+  std::vector<AUSetRule> sets;
+  VectorXf lower;                       // モーフごとの下限
+  VectorXf upper;                       // モーフごとの上限
+};
+
+// フレーム数×AU数の行列(フレームごとのAUが連続して並ぶ)
+typedef Matrix<float, Dynamic, Dynamic, RowMajor> AUMatrix;
+
+// 設定ファイルfname_confから変換規則を作ってmappingに入れる。fname_confが空の場合は組み込みの規則を使う
+// ファイルを開けなければfalseを返す
+bool make_au_mapping(const std::string& fname_conf, int au_size, AUMapping& mapping);
+
+// フレーム数×AU数の行列auをまとめて変換し、フレーム数×モーフ数の行列を返す
+// auはAUのバッファをそのまま指すMap<AUMatrix>などを複製せずに受け取る
+MatrixXf eval_au_mapping(const AUMapping& mapping, const Ref<const AUMatrix>& au);
+
+// eval_au_mappingの結果をモーフごとにキーフレーム列としてmorph_vecに追加する
+// モーフ名がskip_nameのものは追加しない(イベントとして別にキーフレームを作るモーフ)
+void add_morph_tracks(vector<VMD_Morph>& morph_vec, const AUMapping& mapping, const MatrixXf& morph,
+                      const vector<uint32_t>& frame_numbers, const std::string& skip_name = "");
+
+// まばたきのように、閉じて開くだけの動き(フレーム番号は入力のもの)
+struct BlinkEvent {
+  uint32_t onset;   // 閉じ始めるフレーム
+  uint32_t closed;  // 閉じ終わるフレーム
+  uint32_t release; // 開き始めるフレーム
+  uint32_t open;    // 開き終わるフレーム
+};
+
+// 平滑化する前のAction Unitの値x(0～1、frame_numbers[i]フレーム目の値がx[i])から、閉じて開く動きを取り出す
+// close_threshold以上になったら閉じ、open_threshold未満になるか顔を見失ったら開いたものとする
+vector<BlinkEvent> detect_blink_events(const VectorXf& x, const vector<uint32_t>& frame_numbers,
+                                       float close_threshold, float open_threshold);
+
+// eventsを、モーフnameの 0→1→1→0 のキーフレームとしてmorph_vecに追加する
+// フレーム番号はsrcfpsからtgtfpsに変える。重なったイベントはつなげる
+void add_blink_keys(vector<VMD_Morph>& morph_vec, const std::string& name, const vector<BlinkEvent>& events,
+                    float srcfps, float tgtfps);
+
+#endif // ifndef AU_MAPPING_H
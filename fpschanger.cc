@@ -1,19 +1,28 @@
 #include "fpschanger.h"
 
+#include <cmath>
 #include <vector>
 #include "VMD.h"
 #include "interpolate.h"
 
-vector<VMD_Frame> change_fps_bone(const vector<VMD_Frame>& v, float srcfps, float tgtfps, bool bezier)
+// ボーンキーフレーム列vのフレームレートをsrcfpsからtgtfpsに変えてv1に入れる(v1の中身は置き換える)
+void change_fps_bone(const vector<VMD_Frame>& v, float srcfps, float tgtfps, bool bezier, vector<VMD_Frame>& v1)
 {
-  vector<VMD_Frame> v1;
+  v1.clear();
   if (v.size() == 0) {
-    return v1;
+    return;
   }
+  v1.reserve(v.back().number * tgtfps / srcfps + 2);
 
+  // 出力の最初のフレームは、vの先頭の時刻以降で最初の出力フレーム(vが0フレーム目から始まるとは限らない)
   VMD_Frame prev = v[0];
-  v1.push_back(v[0]);
-  int next_frame = 1;
+  float t0 = float(v[0].number) / srcfps;
+  int next_frame = ceil(t0 * tgtfps - 1.0e-3);
+  if (float(next_frame) / tgtfps <= t0) {
+    v1.push_back(v[0]);
+    v1.back().number = next_frame;
+    next_frame++;
+  }
   for (unsigned int i = 1; i < v.size(); ) {
     if (v[i].number == prev.number) {
       i++;
@@ -35,19 +44,39 @@ vector<VMD_Frame> change_fps_bone(const vector<VMD_Frame>& v, float srcfps, floa
       continue;
     }
   }
+  if (v1.empty()) {
+    // 出力のフレームの時刻に届かない短い列(隙間で分けた1つだけのキーフレームなど)は、
+    // 消えないよう先頭のキーフレームを最も近い出力のフレームに置く
+    v1.push_back(v[0]);
+    v1.back().number = lround(t0 * tgtfps);
+  }
+}
+
+vector<VMD_Frame> change_fps_bone(const vector<VMD_Frame>& v, float srcfps, float tgtfps, bool bezier)
+{
+  vector<VMD_Frame> v1;
+  change_fps_bone(v, srcfps, tgtfps, bezier, v1);
   return v1;
 }
 
-vector<VMD_Morph> change_fps_morph(const vector<VMD_Morph>& v, float srcfps, float tgtfps)
+// 表情キーフレーム列vのフレームレートをsrcfpsからtgtfpsに変えてv1に入れる(v1の中身は置き換える)
+void change_fps_morph(const vector<VMD_Morph>& v, float srcfps, float tgtfps, vector<VMD_Morph>& v1)
 {
-  vector<VMD_Morph> v1;
+  v1.clear();
   if (v.size() == 0) {
-    return v1;
+    return;
   }
+  v1.reserve(v.back().frame * tgtfps / srcfps + 2);
 
+  // 出力の最初のフレームは、vの先頭の時刻以降で最初の出力フレーム(vが0フレーム目から始まるとは限らない)
   VMD_Morph prev = v[0];
-  v1.push_back(v[0]);
-  int next_frame = 1;
+  float t0 = float(v[0].frame) / srcfps;
+  int next_frame = ceil(t0 * tgtfps - 1.0e-3);
+  if (float(next_frame) / tgtfps <= t0) {
+    v1.push_back(v[0]);
+    v1.back().frame = next_frame;
+    next_frame++;
+  }
   for (unsigned int i = 1; i < v.size(); ) {
     if (v[i].frame == prev.frame) {
       i++;
@@ -69,6 +98,18 @@ vector<VMD_Morph> change_fps_morph(const vector<VMD_Morph>& v, float srcfps, flo
       continue;
     }
   }
-  return v1;
+  if (v1.empty()) {
+    // 出力のフレームの時刻に届かない短い列(隙間で分けた1つだけのキーフレームなど)は、
+    // 消えないよう先頭のキーフレームを最も近い出力のフレームに置く
+    v1.push_back(v[0]);
+    v1.back().frame = lround(t0 * tgtfps);
+  }
+}
 
+vector<VMD_Morph> change_fps_morph(const vector<VMD_Morph>& v, float srcfps, float tgtfps)
+{
+  vector<VMD_Morph> v1;
+  change_fps_morph(v, srcfps, tgtfps, v1);
+  return v1;
 }
+
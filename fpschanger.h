@@ -9,6 +9,12 @@
 
 vector<VMD_Frame> change_fps_bone(const vector<VMD_Frame>& v, float srcfps, float tgtfps, bool bezier);
 
+// ボーンキーフレーム列vのフレームレートをsrcfpsからtgtfpsに変えてv1に入れる(v1の中身は置き換える)
+void change_fps_bone(const vector<VMD_Frame>& v, float srcfps, float tgtfps, bool bezier, vector<VMD_Frame>& v1);
+
 vector<VMD_Morph> change_fps_morph(const vector<VMD_Morph>& v, float srcfps, float tgtfps);
 
+// 表情キーフレーム列vのフレームレートをsrcfpsからtgtfpsに変えてv1に入れる(v1の中身は置き換える)
+void change_fps_morph(const vector<VMD_Morph>& v, float srcfps, float tgtfps, vector<VMD_Morph>& v1);
+
 #endif // ifndef FPSCHANGER_H
@@ -1,12 +1,16 @@
 // VMDモーションの補間を行う
 #include "interpolate.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <Eigen/Core>
 #include <unsupported/Eigen/NonLinearOptimization>
-#include <unsupported/Eigen/NumericalDiff>
 #include "VMD.h"
+#include "thread_pool.h"
 
 using namespace Eigen;
+using namespace std;
 
 // x座標値がx_argとなる点をベジェ曲線上から探し、その点のy座標値を返す
 // ベジェ曲線の制御点は(0,0), p1, p2, (1,1)とする
@@ -41,9 +45,114 @@ float bezier_y(Vector2f p1, Vector2f p2, float x_arg)
   return bezier3(p1.y(), p2.y(), t);
 }
 
+// ベジェ曲線のx座標値からパラメータtを求めるときに、まとめて計算する単位(ヒープを使わない大きさにする)
+typedef Array<float, Dynamic, 1, ColMajor, 64, 1> BezierChunk;
+
+// x座標値からパラメータtを求める表の分割数
+static const int bezier_table_size = 128;
+
+// 表から初期値を求めた後のニュートン法の反復回数
+static const int bezier_table_iteration = 4;
+
+// x(t) = xとなるtを、tを含む範囲[lower, upper]を狭めながらニュートン法で求める。
+// x(t)は単調増加するので、範囲を外れる(または微分が0になる)ときは二分法にする。
+// t, lower, upperには初期値を入れておく。xの要素ごとにまとめて計算する
+static void bezier_newton(float x1, float x2, const BezierChunk& x, BezierChunk& t, BezierChunk& lower, BezierChunk& upper,
+                          int iteration)
+{
+  for (int i = 0; i < iteration; i++) {
+    BezierChunk s = 1 - t;
+    BezierChunk f = (3 * s * s * x1 + 3 * s * t * x2 + t * t) * t - x;
+    lower = (f < 0).select(t, lower);
+    upper = (f < 0).select(upper, t);
+    BezierChunk d = 3 * s * s * x1 + 6 * s * t * (x2 - x1) + 3 * t * t * (1 - x2);
+    BezierChunk next = t - f / d;
+    t = (next >= lower && next <= upper).select(next, (lower + upper) / 2);
+  }
+}
+
+// 制御点のx座標値がx1, x2のベジェ曲線について、配列xの各要素に対応するパラメータtを求める
+// 制御点が量子化されていない(表を使えない)場合に使う。範囲[0, 1]から始めるので反復を多くする
+static void bezier_t(float x1, float x2, const Ref<const ArrayXf>& x, Ref<ArrayXf> t)
+{
+  const int iteration = 8;
+  int n = x.size();
+  for (int head = 0; head < n; head += BezierChunk::MaxRowsAtCompileTime) {
+    int m = min<int>(BezierChunk::MaxRowsAtCompileTime, n - head);
+    BezierChunk xc = x.segment(head, m);
+    BezierChunk tc = xc.max(0.0f).min(1.0f);
+    BezierChunk lower = BezierChunk::Zero(m);
+    BezierChunk upper = BezierChunk::Ones(m);
+    bezier_newton(x1, x2, xc, tc, lower, upper, iteration);
+    t.segment(head, m) = tc;
+  }
+}
+
+// VMDの補間曲線の、x座標値を等分した点におけるパラメータtの表
+// 制御点のx座標値は0～127に量子化されているので、(x1, x2)の組ごとに初めて使うときに作って使い回す
+static const float* bezier_table(uint8_t ipx1, uint8_t ipx2)
+{
+  static unique_ptr<float[]> tables[128 * 128];
+  static once_flag built[128 * 128];
+  int k = min<int>(ipx1, 127) * 128 + min<int>(ipx2, 127);
+  call_once(built[k], [k] {
+      double x1 = double(k / 128) / 127;
+      double x2 = double(k % 128) / 127;
+      float* table = new float[bezier_table_size + 1];
+      for (int i = 0; i <= bezier_table_size; i++) {
+        // 表は1回だけ作るので、二分法で十分な精度まで求める
+        double x = double(i) / bezier_table_size;
+        double lower = 0.0;
+        double upper = 1.0;
+        for (int j = 0; j < 40; j++) {
+          double t = (lower + upper) / 2;
+          double s = 1 - t;
+          if ((3 * s * s * x1 + 3 * s * t * x2 + t * t) * t < x) {
+            lower = t;
+          } else {
+            upper = t;
+          }
+        }
+        table[i] = (lower + upper) / 2;
+      }
+      tables[k].reset(table);
+    });
+  return tables[k].get();
+}
+
+// VMDの補間曲線パラメータ(0～127)の補間曲線について、配列xの各要素に対応するy座標値をyに入れる
+// パラメータtの初期値とそれを含む範囲を表から求めるので、ニュートン法の反復は少なくて済む。xとyは同じ配列でもよい
+void bezier_y_vmd(uint8_t ipx1, uint8_t ipy1, uint8_t ipx2, uint8_t ipy2, const Ref<const ArrayXf>& x, Ref<ArrayXf> y)
+{
+  const float* table = bezier_table(ipx1, ipx2);
+  float x1 = float(ipx1) / 127;
+  float y1 = float(ipy1) / 127;
+  float x2 = float(ipx2) / 127;
+  float y2 = float(ipy2) / 127;
+  int n = x.size();
+  for (int head = 0; head < n; head += BezierChunk::MaxRowsAtCompileTime) {
+    int m = min<int>(BezierChunk::MaxRowsAtCompileTime, n - head);
+    BezierChunk xc = x.segment(head, m);
+    BezierChunk t(m), lower(m), upper(m);
+    for (int i = 0; i < m; i++) {
+      float pos = min(max(xc[i], 0.0f), 1.0f) * bezier_table_size;
+      int k = min(int(pos), bezier_table_size - 1);
+      lower[i] = table[k];
+      upper[i] = table[k + 1];
+      t[i] = lower[i] + (upper[i] - lower[i]) * (pos - k);
+    }
+    bezier_newton(x1, x2, xc, t, lower, upper, bezier_table_iteration);
+    BezierChunk s = 1 - t;
+    y.segment(head, m) = (3 * s * s * y1 + 3 * s * t * y2 + t * t) * t;
+  }
+}
+
+// VMDの補間曲線パラメータ(0～127)の補間曲線について、x座標値がxとなる点のy座標値を返す
 float bezier_y_vmd(uint8_t ipx1, uint8_t ipy1, uint8_t ipx2, uint8_t ipy2, float x)
 {
-  return bezier_y(Vector2f(float(ipx1)/127, float(ipy1)/127), Vector2f(float(ipx2)/127, float(ipy2)/127), x);
+  float y;
+  bezier_y_vmd(ipx1, ipy1, ipx2, ipy2, Map<const ArrayXf>(&x, 1), Map<ArrayXf>(&y, 1));
+  return y;
 }
 
 VMD_Frame make_intermediate_frame(const VMD_Frame& head_frame, const VMD_Frame& tail_frame, float ratio, bool bezier)
@@ -105,47 +214,66 @@ VMD_Morph interpolate_morph(const VMD_Morph& head_frame, const VMD_Morph& tail_f
   return m;
 }
 
-vector<VMD_Frame> fill_bone_frame(const vector<VMD_Frame>& fv, bool bezier)
+// [first, last)のボーンキーフレームの隙間を補間で埋めてoutに入れる(outの中身は置き換える)
+// outはstartフレーム目から始まる。startより前は最初のキーフレームの値で埋める
+// outの領域は呼び出し元で使い回せるよう、clearして再利用する
+void fill_bone_frame(const VMD_Frame* first, const VMD_Frame* last, uint32_t start, bool bezier, vector<VMD_Frame>& out)
 {
-  vector<VMD_Frame> fv_new;
-  VMD_Frame f_old = fv[0];
-  f_old.number = 0;
-  fv_new.push_back(f_old);
-  for (VMD_Frame f : fv) {
+  out.clear();
+  out.reserve(last[-1].number - start + 1);
+  VMD_Frame f_old = *first;
+  f_old.number = start;
+  out.push_back(f_old);
+  for (const VMD_Frame* p = first; p != last; p++) {
+    const VMD_Frame& f = *p;
     // もしフレーム番号が重複していたら、重複したフレームは消す
     if (f.number == f_old.number) {
       continue;
     }
     // フレーム番号が連続していない場合、途中のフレームを補間する
     for (uint32_t i = f_old.number + 1; i < f.number; i++) {
-      VMD_Frame interpolated = interpolate_frame(f_old, f, i, bezier);
-      fv_new.push_back(interpolated);
+      out.push_back(interpolate_frame(f_old, f, i, bezier));
     }
-    fv_new.push_back(f);
+    out.push_back(f);
     f_old = f;
   }
+}
+
+vector<VMD_Frame> fill_bone_frame(const vector<VMD_Frame>& fv, bool bezier)
+{
+  vector<VMD_Frame> fv_new;
+  fill_bone_frame(fv.data(), fv.data() + fv.size(), 0, bezier, fv_new);
   return fv_new;
 }
 
-vector<VMD_Morph> fill_morph_frame(vector<VMD_Morph>& mv)
+// [first, last)の表情キーフレームの隙間を補間で埋めてoutに入れる(outの中身は置き換える)
+// outはstartフレーム目から始まる。startより前は最初のキーフレームの値で埋める
+void fill_morph_frame(const VMD_Morph* first, const VMD_Morph* last, uint32_t start, vector<VMD_Morph>& out)
 {
-  vector<VMD_Morph> mv_new;
-  VMD_Morph m_old = mv[0];
-  m_old.frame = 0;
-  mv_new.push_back(m_old);
-  for (VMD_Morph m : mv) {
+  out.clear();
+  out.reserve(last[-1].frame - start + 1);
+  VMD_Morph m_old = *first;
+  m_old.frame = start;
+  out.push_back(m_old);
+  for (const VMD_Morph* p = first; p != last; p++) {
+    const VMD_Morph& m = *p;
     // もしフレーム番号が重複していたら、重複したフレームは消す
     if (m.frame == m_old.frame) {
       continue;
     }
     // フレーム番号が連続していない場合、途中のフレームを補間する
     for (uint32_t i = m_old.frame + 1; i < m.frame; i++) {
-      VMD_Morph interpolated = interpolate_morph(m_old, m, i);
-      mv_new.push_back(interpolated);
+      out.push_back(interpolate_morph(m_old, m, i));
     }
-    mv_new.push_back(m);
+    out.push_back(m);
     m_old = m;
   }
+}
+
+vector<VMD_Morph> fill_morph_frame(vector<VMD_Morph>& mv)
+{
+  vector<VMD_Morph> mv_new;
+  fill_morph_frame(mv.data(), mv.data() + mv.size(), 0, mv_new);
   return mv_new;
 }
 
@@ -171,35 +299,69 @@ struct Functor
     int values() const { return m_values; }
 };
 
+// 補間曲線パラメータのフィッティングでまとめて求める、各データ点のパラメータtと、補間の比の制御点による微分
+// ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) とする
+struct BezierSamples {
+  ArrayXf t;  // x座標値がデータ点のxとなるパラメータ
+  ArrayXf by; // そのときのy座標値(補間の比)
+
+  BezierSamples(const VectorXf& p, const ArrayXf& x) : t(x.size()), by(x.size()) {
+    bezier_t(p[0], p[2], x, t);
+    ArrayXf s = 1 - t;
+    by = (3 * s * s * p[1] + 3 * s * t * p[3] + t * t) * t;
+  }
+
+  // 補間の比byの、制御点p[k]による微分をjac.col(k)に入れる
+  // x座標値を固定しているので、x(t) = xからtも制御点のx座標値に依存する(dt/dx1 = -(dx/dx1) / (dx/dt))
+  void jacobian(const VectorXf& p, MatrixXf& jac) const {
+    ArrayXf s = 1 - t;
+    ArrayXf dxdt = 3 * s * s * p[0] + 6 * s * t * (p[2] - p[0]) + 3 * t * t * (1 - p[2]);
+    ArrayXf dydt = 3 * s * s * p[1] + 6 * s * t * (p[3] - p[1]) + 3 * t * t * (1 - p[3]);
+    ArrayXf b1 = 3 * s * s * t; // x(t), y(t)の1つ目の制御点による微分
+    ArrayXf b2 = 3 * s * t * t; // x(t), y(t)の2つ目の制御点による微分
+    // dx/dtが0になる点(端点など)ではtが動かないものとする
+    ArrayXf dydx = (dxdt.abs() > 1.0e-6f).select(dydt / dxdt, 0.0f);
+    jac.col(0) = (-dydx * b1).matrix();
+    jac.col(1) = b1.matrix();
+    jac.col(2) = (-dydx * b2).matrix();
+    jac.col(3) = b2.matrix();
+  }
+};
+
 struct position_functor : Functor<float>
 {
-  position_functor(int nparam, int nvalue, const vector<float>& x, const vector<float>& y)
+  position_functor(int nparam, int nvalue, const ArrayXf& x, const ArrayXf& y)
   : Functor<float>(nparam, nvalue), x(x), y(y) {}
 
-  const vector<float>& x;
-  const vector<float>& y;
+  const ArrayXf& x;
+  const ArrayXf& y;
 
   // 各データ点(x[i], y[i])における誤差をf[i]に格納する
   // パラメータpはベジェ曲線の制御点の座標値
   // ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) となる
   int operator() (const VectorXf& p, VectorXf& f) const
   {
-    Vector2f cp1(p[0], p[1]);
-    Vector2f cp2(p[2], p[3]);
-    for (int i = 0; i < m_values; i++) {
-      float by = bezier_y(cp1, cp2, x[i]);
-      f[i] = y[0]*(1.0-by) + y[m_values - 1]*by - y[i];
-    }
+    BezierSamples b(p, x);
+    f = (y[0] * (1 - b.by) + y[m_values - 1] * b.by - y).matrix();
+    return 0;
+  }
+
+  // 誤差の制御点による微分(ヤコビ行列)をfjacに格納する
+  int df(const VectorXf& p, MatrixXf& fjac) const
+  {
+    BezierSamples b(p, x);
+    b.jacobian(p, fjac);
+    fjac *= y[m_values - 1] - y[0];
     return 0;
   }
 };
 
 struct rotation_functor : Functor<float>
 {
-  rotation_functor(int nparam, int nvalue, const vector<float>& x, const vector<Eigen::Quaternionf>& y)
+  rotation_functor(int nparam, int nvalue, const ArrayXf& x, const vector<Eigen::Quaternionf>& y)
   : Functor<float>(nparam, nvalue), x(x), y(y) {}
 
-  const vector<float>& x;
+  const ArrayXf& x;
   const vector<Eigen::Quaternionf>& y;
 
   // 各データ点における誤差をf[i]に格納する
@@ -207,34 +369,117 @@ struct rotation_functor : Functor<float>
   // ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) となる
   int operator() (const VectorXf& p, VectorXf& f) const
   {
-    Vector2f cp1(p[0], p[1]);
-    Vector2f cp2(p[2], p[3]);
+    BezierSamples b(p, x);
     for (int i = 0; i < m_values; i++) {
-      float by = bezier_y(cp1, cp2, x[i]);
-      Eigen::Quaternionf rot = y[0].slerp(by, y[m_values - 1]);
+      Eigen::Quaternionf rot = y[0].slerp(b.by[i], y[m_values - 1]);
       f[i] = rot.angularDistance(y[i]);
     }
     return 0;
   }
+
+  // 誤差の制御点による微分(ヤコビ行列)をfjacに格納する
+  // 誤差は補間した回転q(by) = s0(by) * y[0] + s1(by) * y[m-1](球面線形補間)とy[i]の差 r = q * conj(y[i]) の角度
+  // 2 * atan2(|r.vec|, |r.w|)なので、これをbyで微分したものに、byの制御点による微分を掛ける
+  int df(const VectorXf& p, MatrixXf& fjac) const
+  {
+    BezierSamples b(p, x);
+    b.jacobian(p, fjac);
+    const Quaternionf& q0 = y[0];
+    const Quaternionf& q1 = y[m_values - 1];
+    // Quaternion::slerpと同じ係数とその微分
+    float d = q0.dot(q1);
+    float abs_d = abs(d);
+    float theta = 0.0;
+    float sin_theta = 0.0;
+    bool linear = abs_d >= 1 - NumTraits<float>::epsilon();
+    if (!linear) {
+      theta = acos(abs_d);
+      sin_theta = sin(theta);
+    }
+    float sign = (d < 0) ? -1.0 : 1.0;
+    for (int i = 0; i < m_values; i++) {
+      float tau = b.by[i];
+      float s0, s1, ds0, ds1;
+      if (linear) {
+        s0 = 1 - tau;
+        s1 = tau;
+        ds0 = -1;
+        ds1 = 1;
+      } else {
+        s0 = sin((1 - tau) * theta) / sin_theta;
+        s1 = sin(tau * theta) / sin_theta;
+        ds0 = -theta * cos((1 - tau) * theta) / sin_theta;
+        ds1 = theta * cos(tau * theta) / sin_theta;
+      }
+      Vector4f q = s0 * q0.coeffs() + sign * s1 * q1.coeffs();    // (x, y, z, w)
+      Vector4f dq = ds0 * q0.coeffs() + sign * ds1 * q1.coeffs();
+      Quaternionf conj = y[i].conjugate();
+      Quaternionf r = Quaternionf(q) * conj;
+      Quaternionf dr = Quaternionf(dq) * conj;
+      float v = r.vec().norm();
+      float w = abs(r.w());
+      float dv = (v > 0) ? r.vec().dot(dr.vec()) / v : 0.0f;
+      float dw = (r.w() < 0) ? -dr.w() : dr.w();
+      float denom = v * v + w * w;
+      float dangle = (denom > 0) ? 2 * (w * dv - v * dw) / denom : 0.0f;
+      fjac.row(i) *= dangle;
+    }
+    return 0;
+  }
 };
 
-// head番めからtail番目までの誤差が最小になるような補間曲線パラメータを探す
-VectorXf find_bezier_parameter_pos(const vector<VMD_Frame>& v, int head, int tail, int axis)
+// 補間曲線パラメータのフィッティングに使うデータ点の最大数
+// 長い区間ではこの数のデータ点を等間隔に選んでフィッティングし、区間全体での誤差は呼び出し元で確かめる
+static const int bezier_fit_samples = 64;
+
+// 区間のうちフィッティングに使うデータ点の番号(両端を含む)
+static vector<int> bezier_fit_index(int head, int tail)
 {
-  vector<float> x;
-  vector<float> y;
-  for (int i = head; i <= tail; i++) {
-    int current = v[i].number;
-    x.push_back(float(current - head)/(tail - head));
-    y.push_back(v[i].position(axis));
+  int n = tail - head + 1;
+  int m = min(n, bezier_fit_samples);
+  vector<int> index(m);
+  for (int k = 0; k < m; k++) {
+    index[k] = (m == n) ? head + k : head + int(int64_t(k) * (n - 1) / (m - 1));
   }
-  // パラメータの初期値を与える
-  // ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) となる
+  return index;
+}
+
+// データ点のx座標値(フレーム番号による比)
+static ArrayXf bezier_fit_x(const vector<VMD_Frame>& v, const vector<int>& index)
+{
+  int head = index.front();
+  int tail = index.back();
+  ArrayXf x(index.size());
+  for (size_t k = 0; k < index.size(); k++) {
+    // フレーム番号で比を求める(トラックが0フレーム目から始まるとは限らない)
+    x[k] = float(v[index[k]].number - v[head].number) / (v[tail].number - v[head].number);
+  }
+  return x;
+}
+
+// 補間曲線パラメータの初期値
+// ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) となる
+static VectorXf bezier_initial_parameter()
+{
   VectorXf p(4);
   p << 20.0/127, 20.0/127, 107.0/127, 107.0/127;
-  position_functor functor(4, (tail - head + 1), x, y);
-  NumericalDiff<position_functor> nd(functor);
-  LevenbergMarquardt<NumericalDiff<position_functor>, float> lm(nd);
+  return p;
+}
+
+// head番めからtail番目までの誤差が最小になるような補間曲線パラメータを探す
+// 誤差の微分は解析的に求める。長い区間は間引いたデータ点で求める
+VectorXf find_bezier_parameter_pos(const vector<VMD_Frame>& v, int head, int tail, int axis)
+{
+  vector<int> index = bezier_fit_index(head, tail);
+  int m = index.size();
+  ArrayXf x = bezier_fit_x(v, index);
+  ArrayXf y(m);
+  for (int k = 0; k < m; k++) {
+    y[k] = v[index[k]].position(axis);
+  }
+  VectorXf p = bezier_initial_parameter();
+  position_functor functor(4, m, x, y);
+  LevenbergMarquardt<position_functor, float> lm(functor);
   lm.parameters.maxfev = 10;
   lm.minimize(p);
   return p;
@@ -243,21 +488,17 @@ VectorXf find_bezier_parameter_pos(const vector<VMD_Frame>& v, int head, int tai
 // head番めからtail番目までの誤差が最小になるような補間曲線パラメータを探す
 VectorXf find_bezier_parameter_rot(const vector<VMD_Frame>& v, int head, int tail)
 {
-  vector<float> x;
+  vector<int> index = bezier_fit_index(head, tail);
+  int m = index.size();
+  ArrayXf x = bezier_fit_x(v, index);
   vector<Eigen::Quaternionf> y;
-  for (int i = head; i <= tail; i++) {
-    int current = v[i].number;
-    x.push_back(float(current - head)/(tail - head));
-    y.push_back(v[i].rotation);
+  for (int k = 0; k < m; k++) {
+    y.push_back(v[index[k]].rotation);
   }
-  // パラメータの初期値を与える
-  // ベジェ曲線の制御点 = (0, 0), (p[0], p[1]), (p[2], p[3]), (1, 1) となる
-  VectorXf p(4);
-  p << 20.0/127, 20.0/127, 107.0/127, 107.0/127;
+  VectorXf p = bezier_initial_parameter();
   // パラメータpの最適化を行う
-  rotation_functor functor(4, (tail - head + 1), x, y);
-  NumericalDiff<rotation_functor> nd(functor);
-  LevenbergMarquardt<NumericalDiff<rotation_functor>, float> lm(nd);
+  rotation_functor functor(4, m, x, y);
+  LevenbergMarquardt<rotation_functor, float> lm(functor);
   lm.parameters.maxfev = 10;
   lm.minimize(p);
   return p;
@@ -278,29 +519,37 @@ void convert_interpolation(uint8_t* ip, const VectorXf p)
 }
 
 // head番めからtail番目までの誤差が最小になるようtail_frameの補間曲線パラメータを調整する
+// データ点が上限(bezier_fit_samples個)になる区間は、スレッドプールがあればX, Y, Z, 回転の補間パラメータを並列に最適化する
+// フィッティングの手間はデータ点の数で決まるので、それより短い区間はタスクを作る手間の方が大きい
+// 呼び出し元がすでにプールのタスクの中なら(間引きの区間やトラックが並列に処理されているので)分けない
 void optimize_bezier_parameter(VMD_Frame& tail_frame, const vector<VMD_Frame>& v,
-                               int head, int tail)
+                               int head, int tail, ThreadPool* pool)
 {
-  uint8_t ip[4];
-  VectorXf p;
+  VectorXf p[4];
+  auto fit = [&](int k) {
+    // 0～2はX, Y, Z、3は回転
+    p[k] = (k < 3) ? find_bezier_parameter_pos(v, head, tail, k) : find_bezier_parameter_rot(v, head, tail);
+  };
+  if (pool && pool->size() > 1 && !pool->in_task() && tail - head + 1 >= bezier_fit_samples) {
+    TaskGroup group;
+    for (int k = 1; k < 4; k++) {
+      pool->submit(group, [&fit, k] { fit(k); });
+    }
+    fit(0);
+    pool->wait(group);
+  } else {
+    for (int k = 0; k < 4; k++) {
+      fit(k);
+    }
+  }
 
-  // Xの補間パラメータの最適化
-  p = find_bezier_parameter_pos(v, head, tail, 0);
-  convert_interpolation(ip, p);
+  uint8_t ip[4];
+  convert_interpolation(ip, p[0]);
   tail_frame.set_interpolation_x(ip[0], ip[1], ip[2], ip[3]);
-
-  // Yの補間パラメータの最適化
-  p = find_bezier_parameter_pos(v, head, tail, 1);
-  convert_interpolation(ip, p);
+  convert_interpolation(ip, p[1]);
   tail_frame.set_interpolation_y(ip[0], ip[1], ip[2], ip[3]);
-
-  // Zの補間パラメータの最適化
-  p = find_bezier_parameter_pos(v, head, tail, 2);
-  convert_interpolation(ip, p);
+  convert_interpolation(ip, p[2]);
   tail_frame.set_interpolation_z(ip[0], ip[1], ip[2], ip[3]);
-
-  // 回転の補間パラメータの最適化
-  p = find_bezier_parameter_rot(v, head, tail);
-  convert_interpolation(ip, p);
+  convert_interpolation(ip, p[3]);
   tail_frame.set_interpolation_r(ip[0], ip[1], ip[2], ip[3]);
 }
@@ -6,6 +6,8 @@
 
 #include "VMD.h"
 
+class ThreadPool;
+
 using namespace Eigen;
 
 // 制御点(0,0), p1, p2, (1,1)の3次ベジェ曲線上の、パラメータtに対応する点を返す
@@ -24,6 +26,13 @@ float bezier_findt(Vector2f p1, Vector2f p2, float x_arg);
 // x座標値がx_argとなる点をベジェ曲線上から探し、その点のy座標値を返す
 float bezier_y(Vector2f p1, Vector2f p2, float x_arg);
 
+// VMDの補間曲線パラメータ(0～127)の補間曲線について、x座標値がxとなる点のy座標値を返す
+// x座標値からパラメータを求める表を、制御点のx座標値の組ごとに作って使い回す
+float bezier_y_vmd(uint8_t ipx1, uint8_t ipy1, uint8_t ipx2, uint8_t ipy2, float x);
+
+// bezier_y_vmdを配列xの各要素についてまとめて求め、yに入れる
+void bezier_y_vmd(uint8_t ipx1, uint8_t ipy1, uint8_t ipx2, uint8_t ipy2, const Ref<const ArrayXf>& x, Ref<ArrayXf> y);
+
 // head_frameとtail_frameを元に、中間のボーンフレームを作る
 VMD_Frame make_intermediate_frame(const VMD_Frame& head_frame, const VMD_Frame& tail_frame, float ratio, bool bezier);
 
@@ -38,8 +47,16 @@ VMD_Morph interpolate_morph(const VMD_Morph& head_frame, const VMD_Morph& tail_f
 
 vector<VMD_Frame> fill_bone_frame(const vector<VMD_Frame>& fv, bool bezier);
 
+// [first, last)のボーンキーフレームの隙間を補間で埋めてoutに入れる(outの中身は置き換える)
+// outはstartフレーム目から始まる。startより前は最初のキーフレームの値で埋める
+void fill_bone_frame(const VMD_Frame* first, const VMD_Frame* last, uint32_t start, bool bezier, vector<VMD_Frame>& out);
+
 vector<VMD_Morph> fill_morph_frame(vector<VMD_Morph>& mv);
 
+// [first, last)の表情キーフレームの隙間を補間で埋めてoutに入れる(outの中身は置き換える)
+// outはstartフレーム目から始まる。startより前は最初のキーフレームの値で埋める
+void fill_morph_frame(const VMD_Morph* first, const VMD_Morph* last, uint32_t start, vector<VMD_Morph>& out);
+
 // (head+1)番めから(tail-1)番目までの誤差が最小になるような補間曲線パラメータを探す
 VectorXf find_bezier_parameter_r(const vector<VMD_Frame>& v, int head, int tail);
 
@@ -47,7 +64,9 @@ VectorXf find_bezier_parameter_r(const vector<VMD_Frame>& v, int head, int tail)
 VectorXf find_bezier_parameter_pos(const vector<VMD_Frame>& v, int head, int tail, int axis);
 
 // head番めからtail番目までの誤差が最小になるようtail_frameの補間曲線パラメータを調整する
-void optimize_bezier_parameter(VMD_Frame& tail_frame, const vector<VMD_Frame>& v, int head, int tail);
+// poolがあれば、長い区間ではX, Y, Z, 回転のパラメータを並列に求める
+void optimize_bezier_parameter(VMD_Frame& tail_frame, const vector<VMD_Frame>& v, int head, int tail,
+                               ThreadPool* pool = nullptr);
 
 #endif // ifndef INTERPOLATE_H
 
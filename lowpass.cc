@@ -0,0 +1,292 @@
+// ローパスフィルタ
+
+#include <algorithm>
+#include <complex>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <unsupported/Eigen/FFT>
+#include "lowpass.h"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+using namespace Eigen;
+using namespace std;
+
+// 文字列("fft", "butterworth", "fir")をFilterTypeに変換する。不明な文字列ならfalseを返す
+bool parse_filter_type(const string& str, FilterType& type)
+{
+  if (str == "fft") {
+    type = FilterType::FFT;
+  } else if (str == "butterworth") {
+    type = FilterType::Butterworth;
+  } else if (str == "fir") {
+    type = FilterType::FIR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// FFTで高速に計算できる(素因数が2,3,5のみの)n以上の長さを返す
+int fft_friendly_size(int n)
+{
+  for (int m = n; ; m++) {
+    int k = m;
+    while (k % 2 == 0) k /= 2;
+    while (k % 3 == 0) k /= 3;
+    while (k % 5 == 0) k /= 5;
+    if (k == 1) {
+      return m;
+    }
+  }
+}
+
+// 同じ長さnのnch個のチャンネルをまとめて平滑化する
+void LowpassFilter::apply(float* const* channels, int nch, int n)
+{
+  if (n < 2 || nch <= 0) {
+    return;
+  }
+  switch (type) {
+  case FilterType::FFT:
+    apply_fft(channels, nch, n);
+    break;
+  case FilterType::Butterworth:
+    apply_butterworth(channels, nch, n);
+    break;
+  case FilterType::FIR:
+    apply_fir(channels, nch, n);
+    break;
+  }
+}
+
+// FFTで周波数成分を打ち切る
+// 実数のチャンネル2つを実部と虚部に詰めて1回の複素FFTで処理する。
+// フィルタは正負の周波数に対して対称なので、実部と虚部は互いに混ざらない。
+void LowpassFilter::apply_fft(float* const* channels, int nch, int n)
+{
+  if (cutoff_freq <= 0) {
+    // 打ち切る位置が0になり、すべての周波数成分が消えてしまうので平滑化しない(他のフィルタと同じ)
+    return;
+  }
+  // 素因数の大きい長さはFFTが遅いので、FFTに都合のよい長さまで伸ばす。
+  // 伸ばした部分は末尾の値から先頭の値へ直線でつなぎ、周期的につながるようにする。
+  int data_size = fft_friendly_size(n);
+  int pad = data_size - n;
+
+  // 長いトラックを1回のFFTで処理するとメモリもキャッシュ効率も悪いので、
+  // 上の周期信号を一定長の区間に分け、前後にmargin個ずつ重ねて処理して中央部分だけを使う(overlap-save)。
+  // 理想ローパスフィルタのインパルス応答はsinc関数で減衰が遅いので、marginはカットオフ周期の64倍とする。
+  int margin = 0;
+  int section = data_size;
+  int m = max(2048, int(64 * sampling_freq / cutoff_freq));
+  int len = fft_friendly_size(6 * m);
+  if (data_size > 2 * len) {
+    margin = m;
+    section = len;
+  }
+  int block = section - 2 * margin; // 1区間で出力するデータ数
+
+  // 打ち切る位置(cutoff_idx)を求める： cutoff_idx / section = cutoff_freq / sampling_freq
+  int cutoff_idx = cutoff_freq * section / sampling_freq;
+
+  timebuf.resize(section);
+  blockbuf.resize(block);
+  for (int c = 0; c < nch; c += 2) {
+    float* re = channels[c];
+    float* im = (c + 1 < nch) ? channels[c + 1] : nullptr;
+    auto value = [re, im](int i) { return complex<float>(re[i], im ? im[i] : 0.0f); };
+    const complex<float> first = value(0);
+    const complex<float> last = value(n - 1);
+    // 最後の区間は周期の先頭に回り込んで読むが、そのころには先頭は書き換わっているので元の値を取っておく
+    int headlen = (margin > 0) ? min(n, block + margin) : 0;
+    headbuf.resize(headlen);
+    for (int i = 0; i < headlen; i++) {
+      headbuf[i] = value(i);
+    }
+
+    int pending = -1; // blockbufに溜めている出力の先頭位置
+    int pending_len = 0;
+    for (int s = 0; s < n; s += block) {
+      // 周期信号のs - margin番目から1区間分を読む
+      for (int j = 0; j < section; j++) {
+        int i = s - margin + j;
+        bool wrapped = (i >= data_size);
+        i = ((i % data_size) + data_size) % data_size;
+        if (i >= n) {
+          float r = float(i - n + 1) / (pad + 1);
+          timebuf[j] = last + (first - last) * r;
+        } else if (wrapped) {
+          timebuf[j] = headbuf[i];
+        } else {
+          timebuf[j] = value(i);
+        }
+      }
+      // 前の区間の出力は、この区間を読み終えてから書き戻す
+      for (int j = 0; j < pending_len; j++) {
+        re[pending + j] = blockbuf[j].real();
+        if (im) {
+          im[pending + j] = blockbuf[j].imag();
+        }
+      }
+
+      fft.fwd(freqbuf, timebuf);
+      // フィルタリング(正負の周波数で対称に打ち切る)
+      for (int i = 0; i < section; i++) {
+        int k = (i <= section / 2) ? i : section - i;
+        if (k >= cutoff_idx) {
+          freqbuf[i] = 0.0;
+        }
+      }
+      fft.inv(timebuf, freqbuf);
+
+      pending = s;
+      pending_len = min(block, n - s);
+      copy(timebuf.begin() + margin, timebuf.begin() + margin + pending_len, blockbuf.begin());
+    }
+    for (int j = 0; j < pending_len; j++) {
+      re[pending + j] = blockbuf[j].real();
+      if (im) {
+        im[pending + j] = blockbuf[j].imag();
+      }
+    }
+  }
+}
+
+// channelsのc0番目から8チャンネル分を、両端を折り返して伸ばしながらlanebufに詰める
+// 両端はx[-k] = 2x[0] - x[k]のように点対称に折り返すので、端の値と傾きが保たれる
+void LowpassFilter::load_lanes(float* const* channels, int nch, int c0, int n, int pad)
+{
+  lanebuf.resize(n + 2 * pad);
+  for (int j = 0; j < Lane::SizeAtCompileTime; j++) {
+    int c = c0 + j;
+    if (c >= nch) {
+      for (int t = 0; t < n + 2 * pad; t++) {
+        lanebuf[t][j] = 0;
+      }
+      continue;
+    }
+    const float* x = channels[c];
+    for (int t = 0; t < pad; t++) {
+      int k = min(pad - t, n - 1);
+      lanebuf[t][j] = 2 * x[0] - x[k];
+      lanebuf[pad + n + t][j] = 2 * x[n - 1] - x[max(n - 2 - t, 0)];
+    }
+    for (int i = 0; i < n; i++) {
+      lanebuf[pad + i][j] = x[i];
+    }
+  }
+}
+
+// srcのoffset番目からn個の値を、channelsのc0番目から8チャンネル分に書き戻す
+void LowpassFilter::store_lanes(float* const* channels, int nch, int c0, int n, int offset, const LaneVector& src)
+{
+  for (int j = 0; j < Lane::SizeAtCompileTime && c0 + j < nch; j++) {
+    float* x = channels[c0 + j];
+    for (int i = 0; i < n; i++) {
+      x[i] = src[offset + i][j];
+    }
+  }
+}
+
+// 2次バターワースフィルタを前向きと後ろ向きにかける(filtfilt)
+// 位相のずれが打ち消されるので、ピークの位置がずれない。計算量はデータ長に比例する
+void LowpassFilter::apply_butterworth(float* const* channels, int nch, int n)
+{
+  if (cutoff_freq <= 0 || cutoff_freq >= sampling_freq / 2) {
+    // フィルタを設計できない
+    return;
+  }
+  // 双一次変換で係数を求める
+  const float k = tan(M_PI * cutoff_freq / sampling_freq);
+  const float norm = 1 / (1 + M_SQRT2 * k + k * k);
+  const float b0 = k * k * norm;
+  const float b1 = 2 * b0;
+  const float b2 = b0;
+  const float a1 = 2 * (k * k - 1) * norm;
+  const float a2 = (1 - M_SQRT2 * k + k * k) * norm;
+
+  // 端の過渡応答が収まるよう、カットオフ周期の3倍の長さだけ両端を伸ばす
+  int pad = 3 * sampling_freq / cutoff_freq + 1;
+  int len = n + 2 * pad;
+  for (int c0 = 0; c0 < nch; c0 += Lane::SizeAtCompileTime) {
+    load_lanes(channels, nch, c0, n, pad);
+    // 状態は端の値が続いていたときの定常状態から始める(直接形II転置型)
+    Lane z1 = (1 - b0) * lanebuf[0];
+    Lane z2 = (b2 - a2) * lanebuf[0];
+    for (int t = 0; t < len; t++) {
+      Lane x = lanebuf[t];
+      Lane y = b0 * x + z1;
+      z1 = b1 * x - a1 * y + z2;
+      z2 = b2 * x - a2 * y;
+      lanebuf[t] = y;
+    }
+    z1 = (1 - b0) * lanebuf[len - 1];
+    z2 = (b2 - a2) * lanebuf[len - 1];
+    for (int t = len - 1; t >= 0; t--) {
+      Lane x = lanebuf[t];
+      Lane y = b0 * x + z1;
+      z1 = b1 * x - a1 * y + z2;
+      z2 = b2 * x - a2 * y;
+      lanebuf[t] = y;
+    }
+    store_lanes(channels, nch, c0, n, pad, lanebuf);
+  }
+}
+
+// 窓関数法(ブラックマン窓)で作ったFIRフィルタをかける
+// 係数が左右対称なので位相はずれない。計算量はデータ長×タップ数に比例する
+void LowpassFilter::apply_fir(float* const* channels, int nch, int n)
+{
+  if (cutoff_freq <= 0 || cutoff_freq >= sampling_freq / 2) {
+    // フィルタを設計できない
+    return;
+  }
+  // 遷移帯域の幅がカットオフ周波数の3分の2程度になるようにタップ数を決める
+  const float fc = cutoff_freq / sampling_freq; // 正規化カットオフ周波数
+  const int half = ceil(4 / fc);
+  const int taps = 2 * half + 1;
+  kernel.resize(taps);
+  float sum = 0;
+  for (int i = 0; i < taps; i++) {
+    float x = 2 * M_PI * fc * (i - half);
+    float sinc = (i == half) ? 1.0f : sin(x) / x;
+    float window = 0.42 - 0.5 * cos(2 * M_PI * i / (taps - 1)) + 0.08 * cos(4 * M_PI * i / (taps - 1));
+    kernel[i] = sinc * window;
+    sum += kernel[i];
+  }
+  for (int i = 0; i < taps; i++) {
+    kernel[i] /= sum;
+  }
+
+  lanebuf2.resize(n);
+  for (int c0 = 0; c0 < nch; c0 += Lane::SizeAtCompileTime) {
+    load_lanes(channels, nch, c0, n, half);
+    for (int t = 0; t < n; t++) {
+      Lane acc = Lane::Zero();
+      for (int i = 0; i < taps; i++) {
+        acc += kernel[i] * lanebuf[t + i];
+      }
+      lanebuf2[t] = acc;
+    }
+    store_lanes(channels, nch, c0, n, 0, lanebuf2);
+  }
+}
+
+void LowpassFilter::apply(vector<float>& v)
+{
+  float* ch = v.data();
+  apply(&ch, 1, v.size());
+}
+
+// 呼び出し側がチャンネルのデータを詰めるための作業領域(c番目、長さn)を返す
+float* LowpassFilter::scratch(int c, int n)
+{
+  if (int(scratchbuf.size()) <= c) {
+    scratchbuf.resize(c + 1);
+  }
+  scratchbuf[c].resize(n);
+  return scratchbuf[c].data();
+}
@@ -0,0 +1,71 @@
+// -*- C++ -*-
+// ローパスフィルタ
+
+#ifndef LOWPASS_H
+#define LOWPASS_H
+
+#include <complex>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <unsupported/Eigen/FFT>
+
+using std::vector;
+
+// ローパスフィルタの種類
+enum class FilterType {
+  FFT,         // FFTで周波数成分を打ち切る
+  Butterworth, // 2次バターワースフィルタを前後両方向にかける(ゼロ位相)
+  FIR,         // 窓関数法で作ったFIRフィルタ(左右対称なのでゼロ位相)
+};
+
+// 文字列("fft", "butterworth", "fir")をFilterTypeに変換する。不明な文字列ならfalseを返す
+bool parse_filter_type(const std::string& str, FilterType& type);
+
+// FFTで高速に計算できる(素因数が2,3,5のみの)n以上の長さを返す
+int fft_friendly_size(int n);
+
+// ローパスフィルタ。cutoff_freqより高い周波数成分を除去する
+// FFTのプランと作業領域はトラックをまたいで使い回すので、
+// 1つのLowpassFilterを複数のスレッドから同時に使ってはいけない
+class LowpassFilter {
+public:
+  LowpassFilter(float cutoff_freq, FilterType type = FilterType::FFT, float sampling_freq = 30.0)
+    : cutoff_freq(cutoff_freq), sampling_freq(sampling_freq), type(type) { }
+
+  // 同じ長さnのnch個のチャンネルをまとめて平滑化する
+  void apply(float* const* channels, int nch, int n);
+  void apply(vector<float>& v);
+
+  // 呼び出し側がチャンネルのデータを詰めるための作業領域(c番目、長さn)を返す
+  float* scratch(int c, int n);
+
+  float cutoff_freq;   // カットオフ周波数[Hz]。0以下の場合は平滑化しない
+  float sampling_freq; // サンプリング周波数[Hz]。フィルタをかけるトラックのフレームレート
+  FilterType type;
+
+private:
+  // 時間領域のフィルタは8チャンネルずつ時刻順に並べて、チャンネル方向にSIMDで計算する
+  typedef Eigen::Array<float, 8, 1> Lane;
+  typedef vector<Lane, Eigen::aligned_allocator<Lane>> LaneVector;
+
+  void apply_fft(float* const* channels, int nch, int n);
+  void apply_butterworth(float* const* channels, int nch, int n);
+  void apply_fir(float* const* channels, int nch, int n);
+  // channelsのc0番目から8チャンネル分を、両端を折り返して伸ばしながらlanebufに詰める
+  void load_lanes(float* const* channels, int nch, int c0, int n, int pad);
+  void store_lanes(float* const* channels, int nch, int c0, int n, int pad, const LaneVector& src);
+
+  Eigen::FFT<float> fft; // 長さごとのプランはFFTオブジェクトの中にキャッシュされる
+  vector<std::complex<float>> timebuf;
+  vector<std::complex<float>> freqbuf;
+  vector<std::complex<float>> headbuf;
+  vector<std::complex<float>> blockbuf;
+  vector<vector<float>> scratchbuf;
+  LaneVector lanebuf;
+  LaneVector lanebuf2;
+  vector<float> kernel;  // FIRフィルタの係数
+};
+
+#endif // ifndef LOWPASS_H
@@ -13,12 +13,15 @@
 #include <Eigen/Geometry>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
+#include "au_mapping.h"
 #include "smooth_reduce.h"
 #include "MMDFileIOUtil.h"
 #include "VMD.h"
 #include "morph_name.h"
+#include "reduce_report.h"
 #include "refine.h"
 
 #define _USE_MATH_DEFINES
@@ -55,6 +58,9 @@ enum AUID {
 };
 const int AU_SIZE = 46;
 const double ACTION_UNIT_MAXVAL = 5.0;
+// まばたきをイベントとして取り出すときの、AU45の閉じた/開いたとみなす値(閉じる方はauconfの@set規則と同じ)
+const float blink_close_threshold = 0.2;
+const float blink_open_threshold = 0.1;
 
 void dumprot(const Quaterniond& rot, string name)
 {
@@ -129,6 +135,27 @@ void add_gaze_pose(vector<VMD_Frame>& frame_vec, cv::Point3f gazedir_left, cv::P
   add_rotation_pose(frame_vec, rot_left, frame_number, u8"右目");
 }
 
+// 一緒に間引くトラックの組(左右の目、頭とセンター、口のモーフ)
+vector<vector<string>> face_joint_groups()
+{
+  return {
+    {u8"左目", u8"右目"},
+    {u8"頭", u8"センター"},
+    {u8"あ", u8"い", u8"う", u8"にやり", u8"∧"},
+  };
+}
+
+// 回転の誤差を点のずれで測るときの、ボーンのローカル座標の代表点(MMDの1mは12.5、正面は-Z)
+// 頭は鼻先、目は1m先の視線の先
+map<string, vector<Vector3f>> face_world_points()
+{
+  return {
+    {u8"頭", {Vector3f(0, 1.0, -1.2)}},
+    {u8"左目", {Vector3f(0, 0, -12.5)}},
+    {u8"右目", {Vector3f(0, 0, -12.5)}},
+  };
+}
+
 // 表情フレームを VMD_Morph の vector に追加する 
 void add_morph_frame(vector<VMD_Morph>& morph_vec, string name, uint32_t frame_number, float weight)
 {
@@ -146,7 +173,7 @@ void add_morph_frame(vector<VMD_Morph>& morph_vec, string name, uint32_t frame_n
 }
 
 // 顔の動きを表すAction Unitをface_analyserから取り出す
-void get_action_unit(double* au, FaceAnalysis::FaceAnalyser face_analyser) {
+void get_action_unit(float* au, FaceAnalysis::FaceAnalyser face_analyser) {
   for (int i = 0; i < AU_SIZE; i++) {
     au[i] = 0;
   }
@@ -176,44 +203,6 @@ void get_action_unit(double* au, FaceAnalysis::FaceAnalyser face_analyser) {
   }
 }
 
-// 顔の表情を推定して morph_vec に追加する
-void estimate_facial_expression(vector<VMD_Morph>& morph_vec, double* au, uint32_t frame_number)
-{
-  // 口
-  double mouth_a = au[AUID::JawDrop] * 2;
-  double mouth_i = 0;
-  double mouth_u = au[AUID::LipTightener] * 2;
-  if (mouth_a < 0.1 && mouth_u < 0.1) {
-    mouth_i = au[AUID::LipPart] * 2;
-  }
-  double mouth_smile = au[AUID::LipCornerPuller];
-
-  add_morph_frame(morph_vec, u8"あ", frame_number, mouth_a);
-  add_morph_frame(morph_vec, u8"い", frame_number, mouth_i);
-  add_morph_frame(morph_vec, u8"う", frame_number, mouth_u);
-  add_morph_frame(morph_vec, u8"にやり", frame_number, mouth_smile);
-  add_morph_frame(morph_vec, u8"∧", frame_number, au[AUID::LipCornerDepressor]);
-
-  // 目
-  double blink = au[AUID::LidTightener];
-  if (au[AUID::Blink] > 0.2) {
-    blink = 1.0;
-  }
-  add_morph_frame(morph_vec, u8"まばたき", frame_number, blink);
-  // まばたき/笑いの切り替えは後処理で行う
-  add_morph_frame(morph_vec, u8"CheekRaiser", frame_number, au[AUID::CheekRaiser]);
-
-  add_morph_frame(morph_vec, u8"びっくり", frame_number, au[AUID::UpperLidRaiser]);
-
-  // 眉
-  add_morph_frame(morph_vec, u8"困る", frame_number, au[AUID::InnerBrowRaiser]);
-  // 困る/にこりの切り替えは後処理で行う
-  add_morph_frame(morph_vec, u8"真面目", frame_number, au[AUID::OuterBrowRaiser]);
-  add_morph_frame(morph_vec, u8"怒り", frame_number, au[AUID::NoseWrinkler]);
-  add_morph_frame(morph_vec, u8"下", frame_number, au[AUID::BrowLowerer]);
-  add_morph_frame(morph_vec, u8"上", frame_number, au[AUID::UpperLidRaiser]);
-}
-
 void init_vmd_header(VMD_Header& h)
 {
   memset(h.version, 0, h.version_len);
@@ -333,15 +322,39 @@ void CustomEstimateGaze(const LandmarkDetector::CLNF& clnf_model, cv::Point3f& g
 }
 // Custom gaze esitmater
 
+// 表情を調整し、モーフとボーンの名前を変えて、VMDファイルに書き出す
+static void write_face_vmd(VMD& vmd, const map<string, string>& rename_map, const string& vmd_file_name)
+{
+  refine_morph(vmd);
+
+  cout << "rename morph & bone" << endl;
+  rename_morph(vmd, rename_map);
+  rename_frame(vmd, rename_map);
+  
+  cout << "VMD output start" << endl;
+  cout << "output filename: " << vmd_file_name << endl;
+  // VMDファイルを書き出す
+  ofstream out(vmd_file_name, ios::binary);
+  vmd.output(out);
+  out.close();
+  cout << "VMD output end" << endl;
+}
+
 // image_file_name で指定された画像/動画ファイルから表情を推定して vmd_file_name に出力する
 RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::string& vmd_file_name,
-			       float cutoff_freq, float threshold_pos, float threshold_rot, float threshold_morph,
-			       const std::string& nameconf_file_name)
+			       const SmoothReduceParam& param,
+			       const std::string& nameconf_file_name, const std::string& auconf_file_name,
+			       float min_confidence, const std::string& policy_file_name,
+			       bool blink_event, float th_world, const std::string& report_file_name)
 {
   map<string, string> rename_map;
   if (nameconf_file_name.length() != 0) {
     rename_map = make_rename_map(string(nameconf_file_name));
   }
+  AUMapping au_mapping;
+  if (!make_au_mapping(auconf_file_name, AU_SIZE, au_mapping)) {
+    return 1;
+  }
   
   vector<string> arg_str;
   arg_str.push_back("-f");
@@ -363,8 +376,27 @@ RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::st
   VMD vmd;
   init_vmd_header(vmd.header);
 
-  float srcfps = cap.fps;
-  float tgtfps = 30.0;
+  SmoothReduceParam sr_param = param;
+  sr_param.srcfps = cap.fps;
+  sr_param.tgtfps = 30.0;
+  if (policy_file_name.length() != 0) {
+    // トラックごとの間引きの設定は、ファイルで指定しなかった項目をコマンドラインの設定と同じにする
+    TrackPolicy defaults{sr_param.threshold_pos, sr_param.threshold_rot, sr_param.threshold_morph, sr_param.bezier, sr_param.metric};
+    sr_param.policies = make_track_policies(policy_file_name, rename_map, defaults);
+  }
+  if (th_world > 0) {
+    // 頭と目の回転は代表点のずれで間引く(トラックごとの設定があればそれに点と閾値を加える)
+    TrackPolicy defaults{sr_param.threshold_pos, sr_param.threshold_rot, sr_param.threshold_morph, sr_param.bezier, sr_param.metric};
+    for (const auto& wp : face_world_points()) {
+      TrackPolicy& policy = sr_param.policies.insert(make_pair(wp.first, defaults)).first->second;
+      policy.threshold_rot = th_world;
+      policy.world_points = wp.second;
+    }
+  }
+
+  // Action Unitはフレームごとに1行ずつ溜めておき、最後にまとめてモーフに変換する
+  vector<float> au_buffer;
+  vector<uint32_t> au_frame_numbers;
 
   for (uint32_t frame_number = 0; true; frame_number++) {
     cout << "frame:" << frame_number << endl;
@@ -377,6 +409,10 @@ RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::st
     if (! LandmarkDetector::DetectLandmarksInVideo(image, face_model, model_parameters, grayscale_image)) {
       continue;
     }
+    // 検出の確からしさ(0～1)が低いフレームは、顔が見つからなかったものとして扱う
+    if (face_model.detection_certainty < min_confidence) {
+      continue;
+    }
 
     // 頭の向きを推定する
     cv::Vec6d head_pose = LandmarkDetector::GetPose(face_model, cap.fx, cap.fy, cap.cx, cap.cy);
@@ -390,9 +426,10 @@ RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::st
 
     // 表情を推定する
     face_analyser.PredictStaticAUsAndComputeFeatures(image, face_model.detected_landmarks);
-    double action_unit[AU_SIZE];
+    float action_unit[AU_SIZE];
     get_action_unit(action_unit, face_analyser);
-    estimate_facial_expression(vmd.morph, action_unit, frame_number);
+    au_buffer.insert(au_buffer.end(), action_unit, action_unit + AU_SIZE);
+    au_frame_numbers.push_back(frame_number);
 
     // 目の向きを推定する
     if (face_model.eye_model) {
@@ -405,28 +442,51 @@ RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::st
     }
   }
 
+  // 表情を推定する
+  Map<AUMatrix> au(au_buffer.data(), au_frame_numbers.size(), AU_SIZE);
+  MatrixXf morph = eval_au_mapping(au_mapping, au);
+  // まばたきをイベントとして取り出す場合は、平滑化と間引きをせずに後でキーフレームを追加する
+  const string blink_name = u8"まばたき";
+  vector<BlinkEvent> blink_events;
+  if (blink_event) {
+    blink_events = detect_blink_events(au.col(Blink), au_frame_numbers, blink_close_threshold, blink_open_threshold);
+    cout << "blink events: " << blink_events.size() << endl;
+  }
+  add_morph_tracks(vmd.morph, au_mapping, morph, au_frame_numbers, blink_event ? blink_name : "");
+
   cout << "smoothing & reduction start" << endl;
-  cout << "cutoff frequency: " << cutoff_freq << endl;
-  cout << "position threshold: " << threshold_pos << endl;
-  cout << "rotation threshold: " << threshold_rot << endl;
-  cout << "morph threshold: " << threshold_morph << endl;
-  smooth_and_reduce(vmd, cutoff_freq, threshold_pos, threshold_rot, threshold_morph,
-                    srcfps, tgtfps, false);
+  cout << "cutoff frequency: " << sr_param.cutoff_freq << endl;
+  cout << "position threshold: " << sr_param.threshold_pos << endl;
+  cout << "rotation threshold: " << sr_param.threshold_rot << endl;
+  cout << "morph threshold: " << sr_param.threshold_morph << endl;
+  cout << "despike: " << sr_param.despike << endl;
+  vector<VMD> level_vmds;
+  if (report_file_name.length() != 0) {
+    // トラックごとの間引いた結果をJSONで書き出す
+    vector<TrackReport> report;
+    smooth_and_reduce(vmd, sr_param, level_vmds, report);
+    if (write_reduce_report(report_file_name, report, rename_map)) {
+      cout << "report: " << report_file_name << endl;
+    }
+  } else {
+    smooth_and_reduce(vmd, sr_param, level_vmds);
+  }
   cout << "smoothing & reduction end" << endl;
+  if (blink_event) {
+    add_blink_keys(vmd.morph, blink_name, blink_events, sr_param.srcfps, sr_param.tgtfps);
+    for (VMD& level_vmd : level_vmds) {
+      add_blink_keys(level_vmd.morph, blink_name, blink_events, sr_param.srcfps, sr_param.tgtfps);
+    }
+  }
 
-  refine_morph(vmd);
-
-  cout << "rename morph & bone" << endl;
-  rename_morph(vmd, rename_map);
-  rename_frame(vmd, rename_map);
-  
-  cout << "VMD output start" << endl;
-  cout << "output filename: " << vmd_file_name << endl;
-  // VMDファイルを書き出す
-  ofstream out(vmd_file_name, ios::binary);
-  vmd.output(out);
-  out.close();
-  cout << "VMD output end" << endl;
+  write_face_vmd(vmd, rename_map, vmd_file_name);
+  // 閾値を変えて間引いたものは、ファイル名に倍率を付けて書き出す(例: face.vmd → face_x2.vmd)
+  for (size_t k = 0; k < level_vmds.size(); k++) {
+    boost::filesystem::path path(vmd_file_name);
+    ostringstream name;
+    name << path.stem().string() << "_x" << sr_param.levels[k] << path.extension().string();
+    write_face_vmd(level_vmds[k], rename_map, (path.parent_path() / name.str()).string());
+  }
   return 0;
 }
 
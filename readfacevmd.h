@@ -4,9 +4,11 @@
 #ifndef READFACEVMD_H
 #define READFACEVMD_H
 
+#include <map>
 #include <string>
 #include <vector>
 #include "VMD.h"
+#include "smooth_reduce.h"
 
 #ifdef RFV_USE_DLL
 #ifdef RFV_DLL_EXPORT
@@ -20,8 +22,17 @@
 
 void add_morph_frame(vector<VMD_Morph>& morph_vec, std::string name, std::uint32_t frame_number, float weight);
 
+// 一緒に間引くトラックの組(左右の目、頭とセンター、口のモーフ)
+std::vector<std::vector<std::string>> face_joint_groups();
+
+// 回転の誤差を点のずれで測るときの、トラック(UTF-8の名前)ごとのボーンのローカル座標の代表点(頭は鼻先、目は視線の先)
+std::map<std::string, std::vector<Vector3f>> face_world_points();
+
 RFV_DLL_DECL int read_face_vmd(const std::string& image_file_name, const std::string& vmd_file_name,
-			       float cutoff_freq, float threshold_pos, float threshold_rot, float threshold_morph,
-			       const std::string& nameconf_file_name);
+			       const SmoothReduceParam& param,
+			       const std::string& nameconf_file_name, const std::string& auconf_file_name,
+			       float min_confidence = 0.0, const std::string& policy_file_name = "",
+			       bool blink_event = false, float th_world = -1.0,
+			       const std::string& report_file_name = "");
 
 #endif // ifndef READFACEVMD_H
@@ -1,8 +1,10 @@
 // readfacevmd - reads facial expression from photo / movie and generate a VMD motion file.
 
+#include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
 #include <iostream>
 #include <string>
+#include <vector>
 #include "readfacevmd.h"
 
 using namespace std;
@@ -23,11 +25,27 @@ int main(int argc, char* argv[])
   opt::options_description desc("options");
   desc.add_options()
     ("help", "help message")
+    ("min_confidence", opt::value<float>(), "skip frames whose face detection confidence (0-1) is below this value")
+    ("despike", opt::value<float>(), "remove 1-2 frame spikes deviating from the rolling median by more than this many sigmas (0: off)")
     ("cutoff", opt::value<float>(), "cutoff frequency [Hz]")
+    ("filter", opt::value<string>(), "lowpass filter type (fft, butterworth, fir)")
+    ("decimate_first", "change the frame rate to 30fps before smoothing (faster for high frame rate movies)")
     ("th_pos", opt::value<float>(), "position threshold of keyframe reduction")
     ("th_rot", opt::value<float>(), "rotation threshold of keyframe reduction [degree]")
     ("th_morph", opt::value<float>(), "morph threshold of keyframe reduction")
+    ("th_world", opt::value<float>(), "reduce head / eye rotations by displacement of the nose tip / gaze target 1m ahead, with this threshold in model units (<= 0: off)")
+    ("levels", opt::value<string>(), "also write VMDs reduced with thresholds scaled by these factors (e.g. 0.5,2,4)")
+    ("max_keys", opt::value<int>(), "maximum number of keyframes per track, in the main output and the levels outputs (0: unlimited, otherwise at least 2; also caps tracks with a negative threshold)")
+    ("target_kps", opt::value<float>(), "search thresholds (bone / morph separately) so that each track gets this many keyframes per second (0: off, not used with levels / max_keys)")
+    ("joint", "put keyframes of related tracks (eyes, head & center, mouth morphs) on the same frames (not used with levels / max_keys / target_kps)")
+    ("blink_event", "key blinks as onset / closed / release / open events taken from raw AU45 instead of smoothing & reducing the blink morph")
+    ("metric", opt::value<string>(), "error metric of keyframe reduction (max, rms)")
+    ("policy", opt::value<string>(), "per-track reduction policy file (lines of name,pos=..,rot=..,morph=..,interp=linear|bezier,metric=max|rms; names after nameconf)")
+    ("report", opt::value<string>(), "write per-track keyframe counts and reconstruction errors (max, rms, p99) of the reduced motion to this JSON file")
     ("nameconf", opt::value<string>(), "morph & bone name config file")
+    ("auconf", opt::value<string>(), "AU to morph mapping config file")
+    ("max_gap", opt::value<int>(), "split tracks where no face is found for more than this many frames (0: never)")
+    ("threads", opt::value<int>(), "number of threads for smoothing & reduction (0: all cores)")
     ;
 
   opt::options_description hidden("hidden options");
@@ -45,10 +63,15 @@ int main(int argc, char* argv[])
   string fname_in;
   string fname_out;
   string fname_nameconf = "";
-  float cutoff_freq = 5.0; // [Hz]
-  float threshold_pos = 0.2;
-  float threshold_rot = 3.0; // [degree]
-  float threshold_morph = 0.1; // 0～1
+  string fname_auconf = "";
+  string fname_policy = "";
+  string fname_report = "";
+  string metric_name = "max";
+  bool blink_event = false;
+  string filter_name = "fft";
+  float min_confidence = 0.0;
+  float th_world = -1.0;
+  SmoothReduceParam param;
   
   try {
     p.add("input-file", 1);
@@ -61,21 +84,95 @@ int main(int argc, char* argv[])
       usage(argv[0], desc);
       return 1;
     }
+    if (vm.count("min_confidence")) {
+      min_confidence = vm["min_confidence"].as<float>();
+    }
+    if (vm.count("despike")) {
+      param.despike = vm["despike"].as<float>();
+    }
     if (vm.count("cutoff")) {
-      cutoff_freq = vm["cutoff"].as<float>();
+      param.cutoff_freq = vm["cutoff"].as<float>();
+    }
+    if (vm.count("filter")) {
+      filter_name = vm["filter"].as<string>();
+      if (!parse_filter_type(filter_name, param.filter)) {
+        cerr << "unknown filter type: " << filter_name << endl;
+        return 1;
+      }
+    }
+    if (vm.count("decimate_first")) {
+      param.decimate_first = true;
     }
     if (vm.count("th_pos")) {
-      threshold_pos = vm["th_pos"].as<float>();
+      param.threshold_pos = vm["th_pos"].as<float>();
     }
     if (vm.count("th_rot")) {
-      threshold_rot = vm["th_rot"].as<float>();
+      param.threshold_rot = vm["th_rot"].as<float>();
     }
     if (vm.count("th_morph")) {
-      threshold_morph = vm["th_morph"].as<float>();
+      param.threshold_morph = vm["th_morph"].as<float>();
+    }
+    if (vm.count("th_world")) {
+      th_world = vm["th_world"].as<float>();
+    }
+    if (vm.count("levels")) {
+      vector<string> fields;
+      boost::algorithm::split(fields, vm["levels"].as<string>(), boost::is_any_of(","));
+      for (const string& f : fields) {
+        float scale = stof(f);
+        if (scale <= 0) {
+          cerr << "levels must be positive: " << f << endl;
+          return 1;
+        }
+        param.levels.push_back(scale);
+      }
+    }
+    if (vm.count("max_keys")) {
+      param.max_keys = vm["max_keys"].as<int>();
+      if (param.max_keys < 0 || param.max_keys == 1) {
+        // 区間の両端の2個も残せない上限は守れない
+        cerr << "max_keys must be 0 (unlimited) or at least 2: " << param.max_keys << endl;
+        return 1;
+      }
+    }
+    if (vm.count("target_kps")) {
+      param.target_kps = vm["target_kps"].as<float>();
+    }
+    if (vm.count("metric")) {
+      metric_name = vm["metric"].as<string>();
+      if (metric_name == "max") {
+        param.metric = ErrorMetric::Max;
+      } else if (metric_name == "rms") {
+        param.metric = ErrorMetric::RMS;
+      } else {
+        cerr << "unknown error metric: " << metric_name << endl;
+        return 1;
+      }
+    }
+    if (vm.count("blink_event")) {
+      blink_event = true;
+    }
+    if (vm.count("policy")) {
+      fname_policy = vm["policy"].as<string>();
+    }
+    if (vm.count("report")) {
+      fname_report = vm["report"].as<string>();
     }
     if (vm.count("nameconf")) {
       fname_nameconf = vm["nameconf"].as<string>();
     }
+    if (vm.count("auconf")) {
+      fname_auconf = vm["auconf"].as<string>();
+    }
+    if (vm.count("joint")) {
+      param.joint_groups = face_joint_groups();
+    }
+    if (vm.count("max_gap")) {
+      param.max_gap = vm["max_gap"].as<int>();
+    }
+    if (vm.count("threads")) {
+      param.num_threads = vm["threads"].as<int>();
+    }
     fname_in = vm["input-file"].as<string>();
     fname_out = vm["output-file"].as<string>();
   } catch (exception& e) {
@@ -84,13 +181,34 @@ int main(int argc, char* argv[])
   }
   cout << "input file: " << fname_in << endl;
   cout << "output file: " << fname_out << endl;
-  cout << "cutoff:" << cutoff_freq << endl;
-  cout << "threshold(position): " << threshold_pos << endl;
-  cout << "threshold(rotation): " << threshold_rot << endl;
-  cout << "threshold(morph): " << threshold_morph << endl;
+  cout << "min_confidence: " << min_confidence << endl;
+  cout << "despike: " << param.despike << endl;
+  cout << "cutoff:" << param.cutoff_freq << endl;
+  cout << "filter: " << filter_name << endl;
+  cout << "decimate_first: " << param.decimate_first << endl;
+  cout << "threshold(position): " << param.threshold_pos << endl;
+  cout << "threshold(rotation): " << param.threshold_rot << endl;
+  cout << "threshold(morph): " << param.threshold_morph << endl;
+  cout << "threshold(world): " << th_world << endl;
+  cout << "levels:";
+  for (float scale : param.levels) {
+    cout << " " << scale;
+  }
+  cout << endl;
+  cout << "max_keys: " << param.max_keys << endl;
+  cout << "target_kps: " << param.target_kps << endl;
+  cout << "joint: " << !param.joint_groups.empty() << endl;
   cout << "nameconf: " << fname_nameconf << endl;
+  cout << "auconf: " << fname_auconf << endl;
+  cout << "metric: " << metric_name << endl;
+  cout << "policy: " << fname_policy << endl;
+  cout << "blink_event: " << blink_event << endl;
+  cout << "report: " << fname_report << endl;
+  cout << "max_gap: " << param.max_gap << endl;
+  cout << "threads: " << param.num_threads << endl;
   
-  int ret = read_face_vmd(fname_in, fname_out, cutoff_freq, threshold_pos, threshold_rot, threshold_morph, fname_nameconf);
+  int ret = read_face_vmd(fname_in, fname_out, param, fname_nameconf, fname_auconf, min_confidence, fname_policy, blink_event,
+			  th_world, fname_report);
   
   return ret;
 }
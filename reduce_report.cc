@@ -0,0 +1,94 @@
+// 間引いたVMDモーションの再構成誤差のレポート
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "reduce_report.h"
+
+using namespace std;
+
+// 各フレームの誤差errの統計を求める。99パーセンタイルは小さい方からceil(0.99 * n)番目の値にする
+ErrorStats error_stats(vector<float>& err)
+{
+  ErrorStats stats;
+  if (err.empty()) {
+    return stats;
+  }
+  double sum_sq = 0.0;
+  for (float e : err) {
+    stats.max = max(stats.max, e);
+    sum_sq += double(e) * e;
+  }
+  stats.rms = sqrt(sum_sq / err.size());
+  size_t k = size_t(ceil(0.99 * err.size())) - 1;
+  nth_element(err.begin(), err.begin() + k, err.end());
+  stats.p99 = err[k];
+  return stats;
+}
+
+// JSONの文字列にする(UTF-8のままで、引用符、バックスラッシュ、制御文字だけをエスケープする)
+static string json_string(const string& s)
+{
+  string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static void write_stats(ofstream& out, const char* key, const ErrorStats& stats)
+{
+  out << json_string(key) << ": {\"max\": " << stats.max << ", \"rms\": " << stats.rms << ", \"p99\": " << stats.p99 << "}";
+}
+
+// {"bones": [{"name": ..., "frames": ..., "keys": ..., "position": {"max", "rms", "p99"}, "rotation": {...}}, ...],
+//  "morphs": [{"name": ..., "frames": ..., "keys": ..., "weight": {...}}, ...]} の形式で書き出す
+bool write_reduce_report(const string& fname, const vector<TrackReport>& report, const map<string, string>& rename_map)
+{
+  ofstream out(fname);
+  if (!out) {
+    cerr << "report: cannot open " << fname << endl;
+    return false;
+  }
+  out.precision(6);
+  out << "{\n";
+  for (int bone = 1; bone >= 0; bone--) {
+    out << "  " << json_string(bone ? "bones" : "morphs") << ": [";
+    bool first = true;
+    for (const TrackReport& r : report) {
+      if (r.bone != bool(bone)) {
+        continue;
+      }
+      auto iter = rename_map.find(r.name);
+      const string& name = (iter == rename_map.end()) ? r.name : iter->second;
+      out << (first ? "\n" : ",\n") << "    {\"name\": " << json_string(name)
+          << ", \"frames\": " << r.frames << ", \"keys\": " << r.keys << ", ";
+      if (r.bone) {
+        write_stats(out, "position", r.pos);
+        out << ", ";
+        write_stats(out, "rotation", r.rot);
+      } else {
+        write_stats(out, "weight", r.morph);
+      }
+      out << "}";
+      first = false;
+    }
+    out << (first ? "]" : "\n  ]") << (bone ? ",\n" : "\n");
+  }
+  out << "}\n";
+  return bool(out);
+}
@@ -0,0 +1,37 @@
+// -*- C++ -*-
+// 間引いたVMDモーションの再構成誤差のレポート
+
+#ifndef REDUCE_REPORT_H
+#define REDUCE_REPORT_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// 1つのトラックの各フレームの誤差の統計
+struct ErrorStats {
+  float max = 0.0;
+  float rms = 0.0;
+  float p99 = 0.0; // 99パーセンタイル
+};
+
+// 1つのトラックを間引いた結果
+struct TrackReport {
+  std::string name;    // トラック名(UTF-8)
+  bool bone = false;   // ボーンのトラックか(falseなら表情)
+  size_t frames = 0;   // 間引く前のフレーム数(平滑化してフレームレートを変えた後)
+  size_t keys = 0;     // 間引いた後のキーフレーム数
+  ErrorStats pos;      // 位置の誤差(ボーン)
+  ErrorStats rot;      // 回転の誤差[degree](ボーン)
+  ErrorStats morph;    // 表情の値の誤差(表情)
+};
+
+// 各フレームの誤差errの統計を求める(errの順序は変わる)
+ErrorStats error_stats(std::vector<float>& err);
+
+// トラック名をrename_mapで変えて、レポートをJSONでfnameに書き出す
+bool write_reduce_report(const std::string& fname, const std::vector<TrackReport>& report,
+                         const std::map<std::string, std::string>& rename_map);
+
+#endif // ifndef REDUCE_REPORT_H
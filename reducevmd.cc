@@ -1,114 +1,916 @@
 // VMDモーションを間引く
 
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <utility>
 #include <vector>
 #include <Eigen/Core>
 #include "VMD.h"
 #include "interpolate.h"
 #include "reducevmd.h"
+#include "thread_pool.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
-// head番目からtail番目のボーンキーフレームのうち、残すべきものを再帰的に探して返す。
-// ただし返値にtail番目のボーンは含まれないので、コール元で追加する必要がある。
-vector<VMD_Frame> reduce_bone_frame_recursive(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier)
+using namespace std;
+
+// 区間を両端のキーフレームで補間したときの誤差
+struct BoneIntervalError {
+  float pos_err = 0.0; // 位置の誤差(ErrorMetric::Maxなら最大値、RMSなら二乗平均平方根)
+  float rot_err = 0.0; // 回転の誤差[degree]。world_pointsがあれば点の移動量(モデルの長さの単位)
+  int pos_idx = 0;     // 位置の誤差が最大のフレーム
+  int rot_idx = 0;     // 回転の誤差が最大のフレーム
+};
+
+// 区間の誤差をまとめて計算するため、ボーンキーフレーム列の値を成分ごとの配列に並べ直したもの
+struct BoneTrackArrays {
+  ArrayXf number, px, py, pz, qw, qx, qy, qz;
+
+  explicit BoneTrackArrays(const vector<VMD_Frame>& v) {
+    int n = v.size();
+    for (ArrayXf* a : {&number, &px, &py, &pz, &qw, &qx, &qy, &qz}) {
+      a->resize(n);
+    }
+    for (int i = 0; i < n; i++) {
+      number[i] = v[i].number;
+      px[i] = v[i].position.x();
+      py[i] = v[i].position.y();
+      pz[i] = v[i].position.z();
+      qw[i] = v[i].rotation.w();
+      qx[i] = v[i].rotation.x();
+      qy[i] = v[i].rotation.y();
+      qz[i] = v[i].rotation.z();
+    }
+  }
+};
+
+// q0からq1への球面線形補間の、補間の比rごとの係数(Quaternion::slerpと同じもの)をs0, s1に入れる
+// 補間した回転は s0 * q0 + s1 * q1 になる
+static void slerp_coefficients(const Quaternionf& q0, const Quaternionf& q1, const Ref<const ArrayXf>& r,
+                               Ref<ArrayXf> s0, Ref<ArrayXf> s1)
 {
-  float max_pos_err = 0.0;
-  float max_rot_err = 0.0;
-  int max_idx_pos = 0;
-  int max_idx_rot = 0;
-  VMD_Frame head_frame = v[head];
-  VMD_Frame tail_frame = v[tail];
-  const int bezier_interpolation_limit = 60;
-  if (bezier && tail - head < bezier_interpolation_limit) {
-    optimize_bezier_parameter(tail_frame, v, head, tail);
+  float d = q0.dot(q1);
+  float abs_d = fabs(d);
+  if (abs_d >= 1 - NumTraits<float>::epsilon()) {
+    s0 = 1 - r;
+    s1 = r;
+  } else {
+    float theta = acos(abs_d);
+    float sin_theta = sin(theta);
+    s0 = ((1 - r) * theta).sin() / sin_theta;
+    s1 = (r * theta).sin() / sin_theta;
+  }
+  if (d < 0) {
+    s1 = -s1;
   }
+}
+
+// 区間の誤差の計算に使う作業領域(区間ごとに使い回す)
+struct BoneErrorWork {
+  ArrayXf rx, ry, rz, rr; // 補間の比(位置のx,y,z、回転)
+  ArrayXf ix, iy, iz;     // 補間した位置
+  ArrayXf s0, s1;         // 球面線形補間の係数
+  ArrayXf err;
 
-  // headフレームの値とtailフレームの値によって決まる補完曲線(直線)から最も離れた(誤差の大きい)フレームを探す
-  for (int i = head + 1; i < tail; i++) {
-    VMD_Frame f = interpolate_frame(head_frame, tail_frame, i, bezier);
-    float pos_err = (f.position - v[i].position).norm();
-    if (pos_err > max_pos_err) {
-      max_idx_pos = i;
-      max_pos_err = pos_err;
+  // m個のフレームを扱えるようにする
+  void reserve(int m) {
+    if (err.size() >= m) {
+      return;
     }
-    float rot_err = fabs(f.rotation.angularDistance(v[i].rotation) * 180 / M_PI);
-    if (rot_err > max_rot_err) {
-      max_idx_rot = i;
-      max_rot_err = rot_err;
+    for (ArrayXf* a : {&rx, &ry, &rz, &rr, &ix, &iy, &iz, &s0, &s1, &err}) {
+      a->resize(m);
     }
   }
+};
 
-  // 補間曲線から最も離れたフレームの誤差が閾値を超えていたら、そのフレーム(max_idx_*)を残し、
-  // [head, max_idx_*] と [max_idx_*, tail] のそれぞれの区間を再帰的に探す。
-  vector<VMD_Frame> v1;
-  if (max_pos_err > threshold_pos) {
-    v1 = reduce_bone_frame_recursive(v, head, max_idx_pos, threshold_pos, threshold_rot, bezier);
-    vector<VMD_Frame> v2 = reduce_bone_frame_recursive(v, max_idx_pos, tail, threshold_pos, threshold_rot, bezier);
-    v1.insert(v1.end(), v2.begin(), v2.end());
+// h番目からt番目のボーンキーフレームを、両端のキーフレームによる補間曲線(直線)で置き換えたときの誤差を求める
+// tail_frameにはt番目のフレーム(bezierなら補間曲線のパラメータを合わせたもの)が入る
+// 長い区間の補間曲線は間引いたフレームで合わせるので、誤差はここで区間の全フレームについて求める
+// 内側のフレームをまとめて補間し、位置は距離の2乗、回転は差の回転の(sin/cos)^2で最大のフレームを探して、
+// 最大のフレームについてだけ距離と角度を求める(平方根や逆三角関数をフレームごとに計算しないため)
+// metricがRMSなら誤差は全フレームの二乗平均平方根にする(分けるフレームは誤差が最大のフレームのまま)
+// world_pointsがあれば、回転の誤差は角度ではなく、ボーンのローカル座標のそれらの点が補間した回転と元の回転で
+// どれだけずれるか(点ごとの距離の最大値)にする
+static BoneIntervalError bone_interval_error(const vector<VMD_Frame>& v, const BoneTrackArrays& a, BoneErrorWork& work,
+                                             int h, int t, bool bezier, VMD_Frame& tail_frame,
+                                             ThreadPool* pool = nullptr, ErrorMetric metric = ErrorMetric::Max,
+                                             const vector<Vector3f>& world_points = vector<Vector3f>())
+{
+  BoneIntervalError e;
+  const VMD_Frame& head_frame = v[h];
+  tail_frame = v[t];
+  if (bezier) {
+    optimize_bezier_parameter(tail_frame, v, h, t, pool);
+  }
+  int m = t - h - 1; // 内側のフレーム数
+  if (m <= 0) {
+    return e;
+  }
+  work.reserve(m);
+
+  // 補間の比
+  float total = tail_frame.number - head_frame.number;
+  work.rr.head(m) = (a.number.segment(h + 1, m) - float(head_frame.number)) / total;
+  if (bezier) {
+    const uint8_t* ip = tail_frame.interpolation;
+    bezier_y_vmd(ip[0], ip[4], ip[8], ip[12], work.rr.head(m), work.rx.head(m));
+    bezier_y_vmd(ip[16], ip[20], ip[24], ip[28], work.rr.head(m), work.ry.head(m));
+    bezier_y_vmd(ip[32], ip[36], ip[40], ip[44], work.rr.head(m), work.rz.head(m));
+    bezier_y_vmd(ip[48], ip[52], ip[56], ip[60], work.rr.head(m), work.rr.head(m));
+    work.ix.head(m) = head_frame.position.x() * (1 - work.rx.head(m)) + tail_frame.position.x() * work.rx.head(m);
+    work.iy.head(m) = head_frame.position.y() * (1 - work.ry.head(m)) + tail_frame.position.y() * work.ry.head(m);
+    work.iz.head(m) = head_frame.position.z() * (1 - work.rz.head(m)) + tail_frame.position.z() * work.rz.head(m);
   } else {
-    if (max_rot_err > threshold_rot) {
-      v1 = reduce_bone_frame_recursive(v, head, max_idx_rot, threshold_pos, threshold_rot, bezier);
-      vector<VMD_Frame> v2 = reduce_bone_frame_recursive(v, max_idx_rot, tail, threshold_pos, threshold_rot, bezier);
-      v1.insert(v1.end(), v2.begin(), v2.end());
+    Vector3f d = tail_frame.position - head_frame.position;
+    work.ix.head(m) = head_frame.position.x() + d.x() * work.rr.head(m);
+    work.iy.head(m) = head_frame.position.y() + d.y() * work.rr.head(m);
+    work.iz.head(m) = head_frame.position.z() + d.z() * work.rr.head(m);
+  }
+
+  // 位置の誤差(距離の2乗)
+  work.err.head(m) = (work.ix.head(m) - a.px.segment(h + 1, m)).square()
+    + (work.iy.head(m) - a.py.segment(h + 1, m)).square()
+    + (work.iz.head(m) - a.pz.segment(h + 1, m)).square();
+  int idx;
+  float max_sq = work.err.head(m).maxCoeff(&idx);
+  if (max_sq > 0) {
+    e.pos_err = (metric == ErrorMetric::RMS) ? sqrt(work.err.head(m).sum() / m) : sqrt(max_sq);
+    e.pos_idx = h + 1 + idx;
+  }
+
+  // 回転の補間(Quaternion::slerpと同じ係数を全フレーム分まとめて求める)
+  const Quaternionf& q0 = head_frame.rotation;
+  const Quaternionf& q1 = tail_frame.rotation;
+  slerp_coefficients(q0, q1, work.rr.head(m), work.s0.head(m), work.s1.head(m));
+  auto iw = work.s0.head(m) * q0.w() + work.s1.head(m) * q1.w();
+  auto ix = work.s0.head(m) * q0.x() + work.s1.head(m) * q1.x();
+  auto iy = work.s0.head(m) * q0.y() + work.s1.head(m) * q1.y();
+  auto iz = work.s0.head(m) * q0.z() + work.s1.head(m) * q1.z();
+  auto w = a.qw.segment(h + 1, m);
+  auto x = a.qx.segment(h + 1, m);
+  auto y = a.qy.segment(h + 1, m);
+  auto z = a.qz.segment(h + 1, m);
+
+  if (!world_points.empty()) {
+    // 元の回転から見た補間した回転 r = conj(v[i].rotation) * q の実部sと虚部u。
+    // 点pのずれは |r p conj(r) - p| = |2s(u×p) + 2u×(u×p)|
+    work.ix.head(m) = iw * w + ix * x + iy * y + iz * z;
+    work.rx.head(m) = w * ix - iw * x + (iy * z - iz * y);
+    work.ry.head(m) = w * iy - iw * y + (iz * x - ix * z);
+    work.rz.head(m) = w * iz - iw * z + (ix * y - iy * x);
+    auto s = work.ix.head(m);
+    auto ux = work.rx.head(m);
+    auto uy = work.ry.head(m);
+    auto uz = work.rz.head(m);
+    work.err.head(m) = 0;
+    for (const Vector3f& p : world_points) {
+      // u×pとu×(u×p) = u(u・p) - p|u|^2
+      auto cx = uy * p.z() - uz * p.y();
+      auto cy = uz * p.x() - ux * p.z();
+      auto cz = ux * p.y() - uy * p.x();
+      auto up = ux * p.x() + uy * p.y() + uz * p.z();
+      auto uu = ux.square() + uy.square() + uz.square();
+      work.iy.head(m) = (2 * (s * cx + ux * up - p.x() * uu)).square()
+        + (2 * (s * cy + uy * up - p.y() * uu)).square()
+        + (2 * (s * cz + uz * up - p.z() * uu)).square();
+      work.err.head(m) = work.err.head(m).max(work.iy.head(m));
+    }
+    float max_sq = work.err.head(m).maxCoeff(&idx);
+    if (max_sq > 0) {
+      e.rot_err = (metric == ErrorMetric::RMS) ? sqrt(work.err.head(m).sum() / m) : sqrt(max_sq);
+      e.rot_idx = h + 1 + idx;
+    }
+    return e;
+  }
+
+  // 補間した回転と元の回転の差 r = q * conj(v[i].rotation) の実部と虚部。角度は2*atan2(|虚部|, |実部|)
+  work.ix.head(m) = iw * w + ix * x + iy * y + iz * z;
+  work.iy.head(m) = (w * ix - iw * x - (iy * z - iz * y)).square()
+    + (w * iy - iw * y - (iz * x - ix * z)).square()
+    + (w * iz - iw * z - (ix * y - iy * x)).square();
+  work.err.head(m) = work.iy.head(m) / work.ix.head(m).square();
+  float max_ratio = work.err.head(m).maxCoeff(&idx);
+  if (max_ratio > 0) {
+    if (metric == ErrorMetric::RMS) {
+      // 角度は2*atan(|虚部|/|実部|)。実部が0ならatan(inf) = π/2になる
+      work.err.head(m) = (work.iy.head(m).sqrt() / work.ix.head(m).abs()).atan();
+      e.rot_err = 2 * sqrt(work.err.head(m).square().sum() / m) * 180 / M_PI;
     } else {
-      v1.push_back(tail_frame);
+      e.rot_err = 2 * atan2(sqrt(work.iy[idx]), fabs(work.ix[idx])) * 180 / M_PI;
     }
+    e.rot_idx = h + 1 + idx;
   }
-  return v1;
+  return e;
 }
 
-// head番目からtail番目のボーンキーフレームのうち、残すべきものを探して返す。
-vector<VMD_Frame> reduce_bone_frame(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier)
+// 誤差が閾値を超えていたら区間を分けるフレームを返す。超えていなければ-1を返す
+// 位置の誤差が閾値を超えていれば位置、そうでなければ回転の誤差が最大のフレームで分ける
+static int bone_split_index(const BoneIntervalError& e, float threshold_pos, float threshold_rot)
+{
+  if (e.pos_err > threshold_pos) {
+    return e.pos_idx;
+  } else if (e.rot_err > threshold_rot) {
+    return e.rot_idx;
+  }
+  return -1;
+}
+
+// 閾値に対する誤差の比。閾値が0なら誤差そのものを非常に小さな閾値で割ったものにする
+static float normalized_error(float err, float threshold)
+{
+  return err / max(threshold, 1.0e-6f);
+}
+
+// この長さ(フレーム数)以上の区間は、スレッドプールがあれば別のタスクとして調べる
+static const int parallel_min_frames = 2048;
+
+// rootから始めて、区間を調べて分けることを繰り返す(Douglas-Peucker法)。
+// visit(node, work, children)は区間nodeを調べ、分けるときは前半と後半の区間をchildrenに入れて2を、分けないときは0を返す。
+// 長いトラックでも再帰が深くならないよう、調べる区間はスタックに積む。
+// 分けた後の区間は互いに独立なので、poolがあれば長い区間はgroupのタスクとして並列に調べる。
+// visitが結果をフレームごとに決まった場所に書けば、スレッド数によらず同じ結果になる
+template <class Work, class Node, class Visit>
+static void split_intervals(const Node& root, ThreadPool* pool, TaskGroup& group, Visit& visit)
+{
+  Work work; // タスクごとの作業領域
+  vector<Node> stack;
+  stack.push_back(root);
+  Node children[2];
+  while (!stack.empty()) {
+    Node node = stack.back();
+    stack.pop_back();
+    int nchild = visit(node, work, children);
+    // 前半を先に調べるよう後半から積む
+    for (int k = nchild - 1; k >= 0; k--) {
+      const Node& child = children[k];
+      if (pool && child.tail - child.head >= parallel_min_frames) {
+        pool->submit(group, [pool, &group, &visit, child] {
+            split_intervals<Work>(child, pool, group, visit);
+          });
+      } else {
+        stack.push_back(child);
+      }
+    }
+  }
+}
+
+// split_intervalsで区間を調べ、すべて終わるまで待つ
+template <class Work, class Node, class Visit>
+static void run_split_intervals(const Node& root, ThreadPool* pool, Visit visit)
+{
+  TaskGroup group;
+  split_intervals<Work>(root, pool, group, visit);
+  if (pool) {
+    pool->wait(group);
+  }
+}
+
+// 区間を表す
+struct Interval {
+  int head;
+  int tail;
+};
+
+// 作業領域のいらない処理のためのもの
+struct NoWork {
+};
+
+// head番目からtail番目のボーンキーフレームのうち、残すべきものを探してoutの末尾に追加する。
+// 区間の両端による補間から最も離れたフレームの誤差が閾値を超えていたらそのフレームで区間を分ける、
+// ということを繰り返す(Douglas-Peucker法)。残すフレームはビットマップに記録して最後にまとめて出力する。
+// poolがあれば長い区間は並列に調べる
+void reduce_bone_frame(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier,
+                       vector<VMD_Frame>& out, ThreadPool* pool, ErrorMetric metric, const vector<Vector3f>& world_points)
+{
+  if (threshold_pos < 0 || threshold_rot < 0) {
+    out.insert(out.end(), v.begin(), v.end());
+    return;
+  }
+
+  BoneTrackArrays arrays(v);
+  vector<uint8_t> keep(tail - head + 1, 0); // keep[i - head]: i番目のフレームを残すか
+  // keep[i - head]が1のとき、i番目のフレームで終わる区間で求めた補間曲線パラメータ
+  vector<array<uint8_t, VMD_Frame::interpolation_len>> leaf_interpolation(bezier ? tail - head + 1 : 0);
+  run_split_intervals<BoneErrorWork>(Interval{head, tail}, pool, [&](const Interval& node, BoneErrorWork& work, Interval* children) {
+      VMD_Frame tail_frame;
+      BoneIntervalError e = bone_interval_error(v, arrays, work, node.head, node.tail, bezier, tail_frame, pool, metric,
+                                                world_points);
+
+      // 補間曲線から最も離れたフレームの誤差が閾値を超えていたら、そのフレームで区間を分ける
+      int split = bone_split_index(e, threshold_pos, threshold_rot);
+      if (split >= 0) {
+        children[0] = Interval{node.head, split};
+        children[1] = Interval{split, node.tail};
+        return 2;
+      }
+      keep[node.tail - head] = 1;
+      if (bezier) {
+        copy(tail_frame.interpolation, tail_frame.interpolation + VMD_Frame::interpolation_len,
+             leaf_interpolation[node.tail - head].begin());
+      }
+      return 0;
+    });
+
+  // 残すフレームを出力する。補間曲線は分けなかった区間ごとに求めたものにする
+  out.push_back(v.front());
+  for (int i = head; i <= tail; i++) {
+    if (!keep[i - head]) {
+      continue;
+    }
+    out.push_back(v[i]);
+    if (bezier) {
+      copy(leaf_interpolation[i - head].begin(), leaf_interpolation[i - head].end(), out.back().interpolation);
+    }
+  }
+}
+
+// 優先度付きキューに入れる、まだ分けるかどうか決めていない区間
+struct BudgetInterval {
+  float err; // 閾値に対する誤差の比
+  int head;
+  int tail;
+  int split; // 分けるときのフレーム
+  int leaf;  // 分けなかったときのtailフレーム(補間曲線を合わせたもの)の番号
+  bool operator<(const BudgetInterval& right) const {
+    return err < right.err;
+  }
+};
+
+// head番目からtail番目のボーンキーフレームから、残すキーフレームがmax_keys個以下になるように選んでoutの末尾に追加する。
+// 閾値に対する誤差の比が最も大きい区間から順に分けていき、max_keys個に達するか、すべての区間の誤差が閾値以下になったら止める。
+// 上限に達しなければreduce_bone_frameと同じ結果になる
+void reduce_bone_frame_budget(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier,
+                              int max_keys, vector<VMD_Frame>& out, ErrorMetric metric, const vector<Vector3f>& world_points)
+{
+  if (threshold_pos < 0 || threshold_rot < 0) {
+    if (int(v.size()) <= max_keys) {
+      out.insert(out.end(), v.begin(), v.end());
+      return;
+    }
+    // 間引かない指定でも上限は守る。負の閾値は0にして、誤差のあるところから順に上限まで残す
+    threshold_pos = max(threshold_pos, 0.0f);
+    threshold_rot = max(threshold_rot, 0.0f);
+  }
+
+  BoneTrackArrays arrays(v);
+  BoneErrorWork work;
+  vector<VMD_Frame> leaf_frames; // 各区間のtailフレーム
+  priority_queue<BudgetInterval> queue;
+  auto push_interval = [&](int h, int t) {
+    VMD_Frame tail_frame;
+    BoneIntervalError e = bone_interval_error(v, arrays, work, h, t, bezier, tail_frame, nullptr, metric, world_points);
+    BudgetInterval interval;
+    interval.err = max(normalized_error(e.pos_err, threshold_pos), normalized_error(e.rot_err, threshold_rot));
+    interval.head = h;
+    interval.tail = t;
+    interval.split = bone_split_index(e, threshold_pos, threshold_rot);
+    interval.leaf = leaf_frames.size();
+    leaf_frames.push_back(tail_frame);
+    queue.push(interval);
+  };
+
+  push_interval(head, tail);
+  int keys = 2;
+  vector<int> leaves; // 分けないことにした区間(leaf_framesの番号)
+  while (!queue.empty()) {
+    BudgetInterval interval = queue.top();
+    queue.pop();
+    if (interval.split < 0 || keys >= max_keys) {
+      leaves.push_back(interval.leaf);
+      continue;
+    }
+    push_interval(interval.head, interval.split);
+    push_interval(interval.split, interval.tail);
+    keys++;
+  }
+
+  sort(leaves.begin(), leaves.end(), [&](int a, int b) { return leaf_frames[a].number < leaf_frames[b].number; });
+  out.push_back(v.front());
+  for (int leaf : leaves) {
+    out.push_back(leaf_frames[leaf]);
+  }
+}
+
+// ボーンキーフレーム列vの間引きの階層を求める
+// 閾値を一律にscale倍して間引くとき、区間の誤差(閾値に対する比)がscaleを超えていたら分割点を残す。
+// 分割点が残るのは自分を含む祖先の区間の誤差がすべてscaleを超えているときなので、その最小値を分割点の重要度とする。
+// 分割点は位置と回転のうち閾値に対する誤差の比が大きい方で選ぶ(scaleによらず階層が決まるように)。
+// min_scale以下の誤差の区間は分けないので、min_scale以上の倍率についてだけ正しい結果になる
+void build_bone_hierarchy(const vector<VMD_Frame>& v, float threshold_pos, float threshold_rot, bool bezier,
+                          float min_scale, ReduceHierarchy& hier, ThreadPool* pool, ErrorMetric metric,
+                          const vector<Vector3f>& world_points)
 {
+  int n = v.size();
+  hier.significance.assign(n, 0.0);
+  hier.leaves.clear();
+  if (n == 0) {
+    return;
+  }
+  hier.significance.front() = numeric_limits<float>::infinity();
+  hier.significance.back() = numeric_limits<float>::infinity();
   if (threshold_pos < 0 || threshold_rot < 0) {
-    vector<VMD_Frame> v1(v);
-    return v1;
+    // 間引かない
+    fill(hier.significance.begin(), hier.significance.end(), numeric_limits<float>::infinity());
+    return;
   }
 
-  vector<VMD_Frame> v1 = reduce_bone_frame_recursive(v, head, tail, threshold_pos, threshold_rot, bezier);
-  v1.insert(v1.begin(), v.front());
+  struct Node {
+    int head;
+    int tail;
+    float significance; // 祖先の区間の誤差の最小値
+  };
+  BoneTrackArrays arrays(v);
+  mutex leaves_mtx;
+  run_split_intervals<BoneErrorWork>(Node{0, n - 1, numeric_limits<float>::infinity()}, pool,
+                                     [&](const Node& node, BoneErrorWork& work, Node* children) {
+      VMD_Frame tail_frame;
+      BoneIntervalError e = bone_interval_error(v, arrays, work, node.head, node.tail, bezier, tail_frame, pool, metric,
+                                                world_points);
+      if (bezier) {
+        BezierLeaf leaf;
+        leaf.head = node.head;
+        leaf.tail = node.tail;
+        copy(tail_frame.interpolation, tail_frame.interpolation + VMD_Frame::interpolation_len, leaf.interpolation.begin());
+        lock_guard<mutex> lock(leaves_mtx);
+        hier.leaves.push_back(leaf);
+      }
+      float pos = normalized_error(e.pos_err, threshold_pos);
+      float rot = normalized_error(e.rot_err, threshold_rot);
+      float err = max(pos, rot);
+      if (err <= min_scale) {
+        return 0;
+      }
+      int split = (pos >= rot) ? e.pos_idx : e.rot_idx;
+      float sig = min(node.significance, err);
+      hier.significance[split] = sig;
+      children[0] = Node{node.head, split, sig};
+      children[1] = Node{split, node.tail, sig};
+      return 2;
+    });
+  // 区間を調べる順序はスレッド数によって変わるので、並べ替えて順序を決める
+  sort(hier.leaves.begin(), hier.leaves.end(), [](const BezierLeaf& a, const BezierLeaf& b) {
+      return (a.tail != b.tail) ? a.tail < b.tail : a.head < b.head;
+    });
+}
+
+// 間引きの階層hierを使って、閾値をscale倍したときに残るボーンキーフレームをoutの末尾に追加する
+// 補間の誤差は計算し直さない(補間曲線も階層を求めたときのものを使う)
+void select_bone_frame(const vector<VMD_Frame>& v, const ReduceHierarchy& hier, float scale, bool bezier, vector<VMD_Frame>& out)
+{
+  int prev = 0;
+  for (int i = 0; i < int(v.size()); i++) {
+    if (i > 0 && !(hier.significance[i] > scale)) {
+      continue;
+    }
+    out.push_back(v[i]);
+    if (bezier && i > 0) {
+      BezierLeaf key;
+      key.head = prev;
+      key.tail = i;
+      auto iter = lower_bound(hier.leaves.begin(), hier.leaves.end(), key, [](const BezierLeaf& a, const BezierLeaf& b) {
+          return (a.tail != b.tail) ? a.tail < b.tail : a.head < b.head;
+        });
+      if (iter != hier.leaves.end() && iter->head == prev && iter->tail == i) {
+        copy(iter->interpolation.begin(), iter->interpolation.end(), out.back().interpolation);
+      }
+    }
+    prev = i;
+  }
+}
 
+// head番目からtail番目のボーンキーフレームのうち、残すべきものを探して返す。
+vector<VMD_Frame> reduce_bone_frame(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier)
+{
+  vector<VMD_Frame> v1;
+  reduce_bone_frame(v, head, tail, threshold_pos, threshold_rot, bezier, v1);
   return v1;
 }
   
-// head番目からtail番目の表情キーフレームのうち、残すべきものを再帰的に探して返す。
-// ただし返値にtail番目のフレームは含まれないので、コール元で追加する必要がある。
-vector<VMD_Morph> reduce_morph_frame_recursive(const vector<VMD_Morph>& v, int head, int tail, float threshold)
+// h番目からt番目の表情キーフレームを、両端のキーフレームによる直線で置き換えたときの最大誤差と、そのフレーム(max_idx)を求める
+static float morph_interval_error(const vector<VMD_Morph>& v, int h, int t, int& max_idx,
+                                  ErrorMetric metric = ErrorMetric::Max)
 {
   float max = 0.0;
-  int max_idx = 0;
-  int total = tail - head;
-  for (int i = head + 1; i < tail; i++) {
-    float iv = v[head].weight + (v[tail].weight - v[head].weight) * (i - head) / total;
+  float sum_sq = 0.0;
+  max_idx = 0;
+  // 補間の比はフレーム番号で求める(値が一定の所をまとめた後は、キーフレームの番号とフレーム番号が比例しない)
+  float total = float(v[t].frame) - v[h].frame;
+  for (int i = h + 1; i < t; i++) {
+    float iv = v[h].weight + (v[t].weight - v[h].weight) * (float(v[i].frame) - v[h].frame) / total;
     float e = abs(iv - v[i].weight);
+    sum_sq += e * e;
     if (e > max) {
       max_idx = i;
       max = e;
     }
   }
+  if (metric == ErrorMetric::RMS && t - h > 1) {
+    return sqrt(sum_sq / (t - h - 1));
+  }
+  return max;
+}
 
-  vector<VMD_Morph> v1;
-  if (max > threshold) {
-    v1 = reduce_morph_frame_recursive(v, head, max_idx, threshold);
-    vector<VMD_Morph> v2 = reduce_morph_frame_recursive(v, max_idx, tail, threshold);
-    v1.insert(v1.end(), v2.begin(), v2.end());
-  } else {
-    v1.push_back(v[head]);
+// head番目からtail番目の表情キーフレームのうち、残すべきものを探してoutの末尾に追加する。
+// ボーンと同様に、ビットマップに記録して最後にまとめて出力する。poolがあれば長い区間は並列に調べる
+void reduce_morph_frame(const vector<VMD_Morph>& v, int head, int tail, float threshold, vector<VMD_Morph>& out, ThreadPool* pool,
+                        ErrorMetric metric)
+{
+  if (threshold < 0) {
+    out.insert(out.end(), v.begin(), v.end());
+    return;
   }
-  return v1;
+
+  vector<uint8_t> keep(tail - head + 1, 0); // keep[i - head]: i番目のフレームを残すか
+  run_split_intervals<NoWork>(Interval{head, tail}, pool, [&](const Interval& node, NoWork&, Interval* children) {
+      int max_idx;
+      float max = morph_interval_error(v, node.head, node.tail, max_idx, metric);
+      if (max > threshold) {
+        children[0] = Interval{node.head, max_idx};
+        children[1] = Interval{max_idx, node.tail};
+        return 2;
+      }
+      keep[node.head - head] = 1;
+      return 0;
+    });
+
+  for (int i = head; i <= tail; i++) {
+    if (keep[i - head]) {
+      out.push_back(v[i]);
+    }
+  }
+  out.push_back(v.back());
 }
 
-// head番目からtail番目の表情キーフレームのうち、残すべきものを探して返す。
-vector<VMD_Morph> reduce_morph_frame(const vector<VMD_Morph>& v, int head, int tail, float threshold)
+// head番目からtail番目の表情キーフレームから、残すキーフレームがmax_keys個以下になるように選んでoutの末尾に追加する。
+// reduce_bone_frame_budgetと同様に、誤差の大きい区間から順に分ける
+void reduce_morph_frame_budget(const vector<VMD_Morph>& v, int head, int tail, float threshold, int max_keys, vector<VMD_Morph>& out,
+                               ErrorMetric metric)
+{
+  if (threshold < 0) {
+    if (int(v.size()) <= max_keys) {
+      out.insert(out.end(), v.begin(), v.end());
+      return;
+    }
+    // 間引かない指定でも上限は守る(ボーンと同じ)
+    threshold = 0.0;
+  }
+
+  priority_queue<BudgetInterval> queue;
+  auto push_interval = [&](int h, int t) {
+    int max_idx;
+    float err = morph_interval_error(v, h, t, max_idx, metric);
+    BudgetInterval interval;
+    interval.err = normalized_error(err, threshold);
+    interval.head = h;
+    interval.tail = t;
+    interval.split = (err > threshold) ? max_idx : -1;
+    interval.leaf = h;
+    queue.push(interval);
+  };
+
+  push_interval(head, tail);
+  int keys = 2;
+  vector<uint8_t> keep(tail - head + 1, 0); // keep[i - head]: i番目のフレームを残すか
+  while (!queue.empty()) {
+    BudgetInterval interval = queue.top();
+    queue.pop();
+    if (interval.split < 0 || keys >= max_keys) {
+      keep[interval.head - head] = 1;
+      continue;
+    }
+    push_interval(interval.head, interval.split);
+    push_interval(interval.split, interval.tail);
+    keys++;
+  }
+
+  for (int i = head; i <= tail; i++) {
+    if (keep[i - head]) {
+      out.push_back(v[i]);
+    }
+  }
+  out.push_back(v.back());
+}
+
+// 表情キーフレーム列vの間引きの階層(各フレームの重要度)をsignificanceに求める
+// 重要度の意味はbuild_bone_hierarchyと同じ
+void build_morph_hierarchy(const vector<VMD_Morph>& v, float threshold, float min_scale, vector<float>& significance, ThreadPool* pool,
+                           ErrorMetric metric)
 {
+  int n = v.size();
+  significance.assign(n, 0.0);
+  if (n == 0) {
+    return;
+  }
+  significance.front() = numeric_limits<float>::infinity();
+  significance.back() = numeric_limits<float>::infinity();
   if (threshold < 0) {
-    vector<VMD_Morph> v1(v);
-    return v1;
+    fill(significance.begin(), significance.end(), numeric_limits<float>::infinity());
+    return;
+  }
+
+  struct Node {
+    int head;
+    int tail;
+    float significance;
+  };
+  run_split_intervals<NoWork>(Node{0, n - 1, numeric_limits<float>::infinity()}, pool, [&](const Node& node, NoWork&, Node* children) {
+      int max_idx;
+      float err = normalized_error(morph_interval_error(v, node.head, node.tail, max_idx, metric), threshold);
+      if (err <= min_scale) {
+        return 0;
+      }
+      float sig = min(node.significance, err);
+      significance[max_idx] = sig;
+      children[0] = Node{node.head, max_idx, sig};
+      children[1] = Node{max_idx, node.tail, sig};
+      return 2;
+    });
+}
+
+// 間引きの階層significanceを使って、閾値をscale倍したときに残る表情キーフレームをoutの末尾に追加する
+void select_morph_frame(const vector<VMD_Morph>& v, const vector<float>& significance, float scale, vector<VMD_Morph>& out)
+{
+  for (size_t i = 0; i < v.size(); i++) {
+    if (significance[i] > scale) {
+      out.push_back(v[i]);
+    }
+  }
+}
+
+// 一緒に間引くトラックの組のうち、残すべきキーフレームを探してbone_outs[k], morph_outs[k]の末尾に追加する。
+// すべてのトラックはキーフレームの数が同じで、同じ番号のキーフレームは同じフレーム番号のものとする。
+// 区間の誤差(閾値に対する比)が最も大きいトラックのそのフレームで区間を分けることを繰り返すので、
+// どのトラックも閾値を満たし、キーフレームはすべてのトラックで同じフレームに置かれる。
+// 閾値が負の種類のトラックは間引かずにそのまま出力する
+void reduce_joint_frame(const vector<const vector<VMD_Frame>*>& bones, const vector<const vector<VMD_Morph>*>& morphs,
+                        float threshold_pos, float threshold_rot, float threshold_morph, bool bezier,
+                        const vector<vector<VMD_Frame>*>& bone_outs, const vector<vector<VMD_Morph>*>& morph_outs, ThreadPool* pool,
+                        ErrorMetric metric)
+{
+  bool reduce_bone = threshold_pos >= 0 && threshold_rot >= 0;
+  bool reduce_morph = threshold_morph >= 0;
+  for (size_t k = 0; k < bones.size(); k++) {
+    if (!reduce_bone) {
+      bone_outs[k]->insert(bone_outs[k]->end(), bones[k]->begin(), bones[k]->end());
+    }
+  }
+  for (size_t k = 0; k < morphs.size(); k++) {
+    if (!reduce_morph) {
+      morph_outs[k]->insert(morph_outs[k]->end(), morphs[k]->begin(), morphs[k]->end());
+    }
+  }
+  int n = !bones.empty() ? bones.front()->size() : !morphs.empty() ? morphs.front()->size() : 0;
+  int nbone = reduce_bone ? bones.size() : 0;
+  int nmorph = reduce_morph ? morphs.size() : 0;
+  if (n == 0 || nbone + nmorph == 0) {
+    return;
   }
 
-  vector<VMD_Morph> v1 = reduce_morph_frame_recursive(v, head, tail, threshold);
-  v1.push_back(v.back());
+  vector<BoneTrackArrays> arrays;
+  for (int k = 0; k < nbone; k++) {
+    arrays.emplace_back(*bones[k]);
+  }
+  vector<uint8_t> keep(n, 0); // keep[i]: i番目のフレームを残すか
+  keep.front() = 1;
+  keep.back() = 1;
+  // leaf_interpolation[k][i]: k番目のボーンの、i番目のフレームで終わる区間で求めた補間曲線パラメータ
+  // 分けた区間のものも書くが、同じフレームで終わる後半の区間が後から上書きするので、最後は分けなかった区間のものになる
+  vector<vector<array<uint8_t, VMD_Frame::interpolation_len>>> leaf_interpolation(bezier ? nbone : 0);
+  for (auto& ip : leaf_interpolation) {
+    ip.resize(n);
+  }
+  run_split_intervals<BoneErrorWork>(Interval{0, n - 1}, pool, [&](const Interval& node, BoneErrorWork& work, Interval* children) {
+      float max_err = 0.0;
+      int split = -1;
+      for (int k = 0; k < nbone; k++) {
+        VMD_Frame tail_frame;
+        BoneIntervalError e = bone_interval_error(*bones[k], arrays[k], work, node.head, node.tail, bezier, tail_frame, pool,
+                                                  metric);
+        if (bezier) {
+          copy(tail_frame.interpolation, tail_frame.interpolation + VMD_Frame::interpolation_len,
+               leaf_interpolation[k][node.tail].begin());
+        }
+        float pos = normalized_error(e.pos_err, threshold_pos);
+        float rot = normalized_error(e.rot_err, threshold_rot);
+        if (pos > max_err) {
+          max_err = pos;
+          split = e.pos_idx;
+        }
+        if (rot > max_err) {
+          max_err = rot;
+          split = e.rot_idx;
+        }
+      }
+      for (int k = 0; k < nmorph; k++) {
+        int max_idx;
+        float err = normalized_error(morph_interval_error(*morphs[k], node.head, node.tail, max_idx, metric), threshold_morph);
+        if (err > max_err) {
+          max_err = err;
+          split = max_idx;
+        }
+      }
+      if (max_err <= 1.0) {
+        return 0;
+      }
+      keep[split] = 1;
+      children[0] = Interval{node.head, split};
+      children[1] = Interval{split, node.tail};
+      return 2;
+    });
+
+  for (int k = 0; k < nbone; k++) {
+    for (int i = 0; i < n; i++) {
+      if (!keep[i]) {
+        continue;
+      }
+      bone_outs[k]->push_back((*bones[k])[i]);
+      if (bezier && i > 0) {
+        copy(leaf_interpolation[k][i].begin(), leaf_interpolation[k][i].end(), bone_outs[k]->back().interpolation);
+      }
+    }
+  }
+  for (int k = 0; k < nmorph; k++) {
+    for (int i = 0; i < n; i++) {
+      if (keep[i]) {
+        morph_outs[k]->push_back((*morphs[k])[i]);
+      }
+    }
+  }
+}
+
+// head番目からtail番目の表情キーフレームのうち、残すべきものを探して返す。
+vector<VMD_Morph> reduce_morph_frame(const vector<VMD_Morph>& v, int head, int tail, float threshold)
+{
+  vector<VMD_Morph> v1;
+  reduce_morph_frame(v, head, tail, threshold, v1);
   return v1;
 }
 
+
+// 値がほぼ一定のキーフレームが続く所を両端だけにしてoutに入れる。一定かどうかは続く所の最初のキーフレームとの差で判定する
+// 内側のフレームとの差も最初のキーフレームとの差もeps以下なので、両端による補間との誤差は2*eps以下になる。
+// 1回の走査で済むので、止まっている所の多いトラックを間引く前に使うと、間引きで調べる区間が減る
+template <typename T, typename Near>
+static void collapse_plateaus(const vector<T>& v, Near near, vector<T>& out)
+{
+  out.clear();
+  int n = v.size();
+  if (n == 0) {
+    return;
+  }
+  int s = 0; // 一定の値が続く所の最初のキーフレーム
+  out.push_back(v[0]);
+  for (int i = 1; i < n; i++) {
+    if (near(v[s], v[i])) {
+      continue;
+    }
+    if (i - 1 > s) {
+      out.push_back(v[i - 1]);
+    }
+    out.push_back(v[i]);
+    s = i;
+  }
+  if (n - 1 > s) {
+    out.push_back(v[n - 1]);
+  }
+}
+
+// ボーンキーフレーム列vの、位置の差がeps_pos以下かつ回転の差がeps_rot[degree]以下のキーフレームが続く所を両端だけにしてoutに入れる
+void collapse_bone_plateaus(const vector<VMD_Frame>& v, float eps_pos, float eps_rot, vector<VMD_Frame>& out)
+{
+  float eps_sq = eps_pos * eps_pos;
+  float min_dot = cos(eps_rot * M_PI / 180 / 2); // 差の回転の角度がeps_rotのときの内積
+  collapse_plateaus(v, [&](const VMD_Frame& a, const VMD_Frame& b) {
+      return (a.position - b.position).squaredNorm() <= eps_sq && fabs(a.rotation.dot(b.rotation)) >= min_dot;
+    }, out);
+}
+
+// 表情キーフレーム列vの、値の差がeps以下のキーフレームが続く所を両端だけにしてoutに入れる
+void collapse_morph_plateaus(const vector<VMD_Morph>& v, float eps, vector<VMD_Morph>& out)
+{
+  collapse_plateaus(v, [&](const VMD_Morph& a, const VMD_Morph& b) { return fabs(a.weight - b.weight) <= eps; }, out);
+}
+
+// ボーンキーフレーム列vのb番目からe-1番目のフレームを、キーフレームk0, k1の補間(interpolate_frameと同じ)と比べた
+// 位置の誤差をpos_err、回転の誤差[degree]をrot_errのb番目からe-1番目に入れる
+static void bone_interval_residual(const BoneTrackArrays& a, int b, int e, const VMD_Frame& k0, const VMD_Frame& k1, bool bezier,
+                                   BoneErrorWork& work, vector<float>& pos_err, vector<float>& rot_err)
+{
+  int m = e - b;
+  work.reserve(m);
+  work.rr.head(m) = (a.number.segment(b, m) - float(k0.number)) / (float(k1.number) - k0.number);
+  if (bezier) {
+    const uint8_t* ip = k1.interpolation;
+    bezier_y_vmd(ip[0], ip[4], ip[8], ip[12], work.rr.head(m), work.rx.head(m));
+    bezier_y_vmd(ip[16], ip[20], ip[24], ip[28], work.rr.head(m), work.ry.head(m));
+    bezier_y_vmd(ip[32], ip[36], ip[40], ip[44], work.rr.head(m), work.rz.head(m));
+    bezier_y_vmd(ip[48], ip[52], ip[56], ip[60], work.rr.head(m), work.rr.head(m));
+    work.ix.head(m) = k0.position.x() * (1 - work.rx.head(m)) + k1.position.x() * work.rx.head(m);
+    work.iy.head(m) = k0.position.y() * (1 - work.ry.head(m)) + k1.position.y() * work.ry.head(m);
+    work.iz.head(m) = k0.position.z() * (1 - work.rz.head(m)) + k1.position.z() * work.rz.head(m);
+  } else {
+    Vector3f d = k1.position - k0.position;
+    work.ix.head(m) = k0.position.x() + d.x() * work.rr.head(m);
+    work.iy.head(m) = k0.position.y() + d.y() * work.rr.head(m);
+    work.iz.head(m) = k0.position.z() + d.z() * work.rr.head(m);
+  }
+  Map<ArrayXf>(pos_err.data() + b, m) = ((work.ix.head(m) - a.px.segment(b, m)).square()
+                                         + (work.iy.head(m) - a.py.segment(b, m)).square()
+                                         + (work.iz.head(m) - a.pz.segment(b, m)).square()).sqrt();
+
+  slerp_coefficients(k0.rotation, k1.rotation, work.rr.head(m), work.s0.head(m), work.s1.head(m));
+  auto iw = work.s0.head(m) * k0.rotation.w() + work.s1.head(m) * k1.rotation.w();
+  auto ix = work.s0.head(m) * k0.rotation.x() + work.s1.head(m) * k1.rotation.x();
+  auto iy = work.s0.head(m) * k0.rotation.y() + work.s1.head(m) * k1.rotation.y();
+  auto iz = work.s0.head(m) * k0.rotation.z() + work.s1.head(m) * k1.rotation.z();
+  auto w = a.qw.segment(b, m);
+  auto x = a.qx.segment(b, m);
+  auto y = a.qy.segment(b, m);
+  auto z = a.qz.segment(b, m);
+  // 差の回転の角度は2*atan(|虚部|/|実部|)(bone_interval_errorと同じ)
+  work.ix.head(m) = iw * w + ix * x + iy * y + iz * z;
+  work.iy.head(m) = (w * ix - iw * x - (iy * z - iz * y)).square()
+    + (w * iy - iw * y - (iz * x - ix * z)).square()
+    + (w * iz - iw * z - (ix * y - iy * x)).square();
+  Map<ArrayXf>(rot_err.data() + b, m) = (work.iy.head(m).sqrt() / work.ix.head(m).abs()).atan() * float(2 * 180 / M_PI);
+}
+
+// ボーンキーフレーム列vのb番目からe-1番目のフレームを、キーフレームkの値のままにしたときの誤差を入れる
+static void bone_hold_residual(const vector<VMD_Frame>& v, int b, int e, const VMD_Frame& k,
+                               vector<float>& pos_err, vector<float>& rot_err)
+{
+  for (int i = b; i < e; i++) {
+    pos_err[i] = (v[i].position - k.position).norm();
+    rot_err[i] = k.rotation.angularDistance(v[i].rotation) * 180 / M_PI;
+  }
+}
+
+// 間引いたボーンキーフレーム列keysを補間して、間引く前のボーンキーフレーム列vの各フレームと比べた
+// 位置の誤差をpos_err、回転の誤差[degree]をrot_errに入れる(vと同じ大きさになる)
+// キーフレームの間のフレームはまとめて補間する。最初のキーフレームより前と最後のキーフレームより後は、端のキーフレームの値と比べる
+void bone_reconstruction_error(const vector<VMD_Frame>& v, const vector<VMD_Frame>& keys, bool bezier,
+                               vector<float>& pos_err, vector<float>& rot_err)
+{
+  int n = v.size();
+  pos_err.assign(n, 0.0);
+  rot_err.assign(n, 0.0);
+  if (n == 0 || keys.empty()) {
+    return;
+  }
+  BoneTrackArrays arrays(v);
+  BoneErrorWork work;
+  auto index = [&](uint32_t number) {
+    return int(lower_bound(v.begin(), v.end(), number,
+                           [](const VMD_Frame& f, uint32_t num) { return f.number < num; }) - v.begin());
+  };
+  int b = index(keys.front().number);
+  bone_hold_residual(v, 0, b, keys.front(), pos_err, rot_err);
+  for (size_t k = 0; k + 1 < keys.size(); k++) {
+    int e = index(keys[k + 1].number);
+    if (e > b) {
+      bone_interval_residual(arrays, b, e, keys[k], keys[k + 1], bezier, work, pos_err, rot_err);
+    }
+    b = max(b, e);
+  }
+  bone_hold_residual(v, b, n, keys.back(), pos_err, rot_err);
+}
+
+// 間引いた表情キーフレーム列keysを補間(interpolate_morphと同じ)して、間引く前の表情キーフレーム列vの各フレームと比べた
+// 誤差をerrに入れる(vと同じ大きさになる)。範囲外の扱いはbone_reconstruction_errorと同じ
+void morph_reconstruction_error(const vector<VMD_Morph>& v, const vector<VMD_Morph>& keys, vector<float>& err)
+{
+  int n = v.size();
+  err.assign(n, 0.0);
+  if (n == 0 || keys.empty()) {
+    return;
+  }
+  ArrayXf number(n), weight(n);
+  for (int i = 0; i < n; i++) {
+    number[i] = v[i].frame;
+    weight[i] = v[i].weight;
+  }
+  Map<ArrayXf> e_all(err.data(), n);
+  auto index = [&](uint32_t frame) {
+    return int(lower_bound(v.begin(), v.end(), frame,
+                           [](const VMD_Morph& m, uint32_t f) { return m.frame < f; }) - v.begin());
+  };
+  int b = index(keys.front().frame);
+  e_all.head(b) = (weight.head(b) - keys.front().weight).abs();
+  for (size_t k = 0; k + 1 < keys.size(); k++) {
+    const VMD_Morph& k0 = keys[k];
+    const VMD_Morph& k1 = keys[k + 1];
+    int e = index(k1.frame);
+    if (e > b) {
+      int m = e - b;
+      float total = float(k1.frame) - k0.frame;
+      e_all.segment(b, m) = (k0.weight + (k1.weight - k0.weight) * (number.segment(b, m) - float(k0.frame)) / total
+                             - weight.segment(b, m)).abs();
+    }
+    b = max(b, e);
+  }
+  e_all.tail(n - b) = (weight.tail(n - b) - keys.back().weight).abs();
+}
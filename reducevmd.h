@@ -4,15 +4,99 @@
 #ifndef REDUCEVMD_H
 #define REDUCEVMD_H
 
+#include <array>
 #include <vector>
 #include "VMD.h"
 
+class ThreadPool;
+
+// 区間を両端のキーフレームで補間したときの誤差の測り方
+enum class ErrorMetric {
+  Max, // 補間から最も離れたフレームの誤差
+  RMS, // 区間の内側のフレームの誤差の二乗平均平方根(ノイズの多いトラックで、1フレームだけのずれでキーフレームを増やさない)
+};
+
+// 区間ごとに求めた補間曲線のパラメータ
+struct BezierLeaf {
+  int head;
+  int tail;
+  std::array<uint8_t, VMD_Frame::interpolation_len> interpolation; // tailフレームの補間曲線
+};
+
+// 間引きの階層。閾値を一律に何倍かしたときに残るキーフレームを、補間の誤差を計算し直さずに求めるためのもの
+struct ReduceHierarchy {
+  vector<float> significance; // 各フレームの重要度。閾値の倍率がこれより小さければ残る(両端は無限大)
+  vector<BezierLeaf> leaves;  // ベジェ曲線で補間する場合の、区間ごとの補間曲線(tail, headの順)
+};
+
 // head番目からtail番目のボーンキーフレームのうち、残すべきものを探して返す。
 vector<VMD_Frame> reduce_bone_frame(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier=false);
 
+// head番目からtail番目のボーンキーフレームのうち、残すべきものを探してoutの末尾に追加する。
+// poolがあれば長い区間を並列に調べる(結果はスレッド数によらない)。metricは区間の誤差の測り方
+// world_pointsがあれば、回転の誤差はボーンのローカル座標のそれらの点のずれ(最大値)で測り、threshold_rotはモデルの長さの単位になる
+void reduce_bone_frame(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier,
+                       vector<VMD_Frame>& out, ThreadPool* pool = nullptr, ErrorMetric metric = ErrorMetric::Max,
+                       const vector<Vector3f>& world_points = vector<Vector3f>());
+
+// head番目からtail番目のボーンキーフレームから、残すキーフレームがmax_keys個以下になるように選んでoutの末尾に追加する。
+// 閾値に対する誤差の比が大きい区間から順に分ける。上限に達しなければreduce_bone_frameと同じ結果になる
+// max_keysは2以上とする。閾値が負(間引かない)でもキーフレームがmax_keys個より多ければ、閾値を0として上限まで残す
+void reduce_bone_frame_budget(const vector<VMD_Frame>& v, int head, int tail, float threshold_pos, float threshold_rot, bool bezier,
+                              int max_keys, vector<VMD_Frame>& out, ErrorMetric metric = ErrorMetric::Max,
+                              const vector<Vector3f>& world_points = vector<Vector3f>());
+
 // head番目からtail番目の表情キーフレームのうち、残すべきものを探して返す。
 vector<VMD_Morph> reduce_morph_frame(const vector<VMD_Morph>& v, int head, int tail, float threshold);
 
+// head番目からtail番目の表情キーフレームのうち、残すべきものを探してoutの末尾に追加する。
+// poolがあれば長い区間を並列に調べる
+void reduce_morph_frame(const vector<VMD_Morph>& v, int head, int tail, float threshold, vector<VMD_Morph>& out,
+                        ThreadPool* pool = nullptr, ErrorMetric metric = ErrorMetric::Max);
+
+// head番目からtail番目の表情キーフレームから、残すキーフレームがmax_keys個以下になるように選んでoutの末尾に追加する。
+void reduce_morph_frame_budget(const vector<VMD_Morph>& v, int head, int tail, float threshold, int max_keys, vector<VMD_Morph>& out,
+                               ErrorMetric metric = ErrorMetric::Max);
+
+// ボーンキーフレーム列vの間引きの階層を求める。閾値の倍率がmin_scale以上のときだけ使える
+// 分割点は位置と回転の誤差の比が大きい方で選ぶので、倍率1.0でもreduce_bone_frameと同じ結果になるとは限らない
+void build_bone_hierarchy(const vector<VMD_Frame>& v, float threshold_pos, float threshold_rot, bool bezier,
+                          float min_scale, ReduceHierarchy& hier, ThreadPool* pool = nullptr,
+                          ErrorMetric metric = ErrorMetric::Max, const vector<Vector3f>& world_points = vector<Vector3f>());
+
+// 間引きの階層hierを使って、閾値をscale倍したときに残るボーンキーフレームをoutの末尾に追加する
+void select_bone_frame(const vector<VMD_Frame>& v, const ReduceHierarchy& hier, float scale, bool bezier, vector<VMD_Frame>& out);
+
+// 表情キーフレーム列vの間引きの階層(各フレームの重要度)をsignificanceに求める
+void build_morph_hierarchy(const vector<VMD_Morph>& v, float threshold, float min_scale, vector<float>& significance,
+                           ThreadPool* pool = nullptr, ErrorMetric metric = ErrorMetric::Max);
+
+// 間引きの階層significanceを使って、閾値をscale倍したときに残る表情キーフレームをoutの末尾に追加する
+void select_morph_frame(const vector<VMD_Morph>& v, const vector<float>& significance, float scale, vector<VMD_Morph>& out);
+
+// 一緒に間引くトラックの組のうち、残すべきキーフレームを探してbone_outs[k], morph_outs[k]の末尾に追加する。
+// すべてのトラックはキーフレームの数とフレーム番号が揃っているものとし、どのトラックも閾値を満たすように共通のフレームを選ぶ
+// metricは区間の誤差の測り方(reduce_bone_frameと同じ)
+void reduce_joint_frame(const vector<const vector<VMD_Frame>*>& bones, const vector<const vector<VMD_Morph>*>& morphs,
+                        float threshold_pos, float threshold_rot, float threshold_morph, bool bezier,
+                        const vector<vector<VMD_Frame>*>& bone_outs, const vector<vector<VMD_Morph>*>& morph_outs,
+                        ThreadPool* pool = nullptr, ErrorMetric metric = ErrorMetric::Max);
+
+// ボーンキーフレーム列vの、位置の差がeps_pos以下かつ回転の差がeps_rot[degree]以下のキーフレームが続く所を両端だけにしてoutに入れる
+// 両端による補間との誤差はそれぞれ2倍以下になる。間引く前に使うと、止まっている所の多いトラックの間引きが速くなる
+void collapse_bone_plateaus(const vector<VMD_Frame>& v, float eps_pos, float eps_rot, vector<VMD_Frame>& out);
+
+// 表情キーフレーム列vの、値の差がeps以下のキーフレームが続く所を両端だけにしてoutに入れる
+void collapse_morph_plateaus(const vector<VMD_Morph>& v, float eps, vector<VMD_Morph>& out);
+
+// 間引いたボーンキーフレーム列keysをinterpolate_frameと同じく補間して、間引く前のボーンキーフレーム列v(フレーム番号順)の
+// 各フレームと比べた位置の誤差をpos_err、回転の誤差[degree]をrot_errに入れる。キーフレームの範囲外は端のキーフレームの値と比べる
+void bone_reconstruction_error(const vector<VMD_Frame>& v, const vector<VMD_Frame>& keys, bool bezier,
+                               vector<float>& pos_err, vector<float>& rot_err);
+
+// 間引いた表情キーフレーム列keysをinterpolate_morphと同じく補間して、間引く前の表情キーフレーム列vの各フレームと比べた誤差をerrに入れる
+void morph_reconstruction_error(const vector<VMD_Morph>& v, const vector<VMD_Morph>& keys, vector<float>& err);
+
 // head_frameとtail_frameを元に、補間でframe_num番目のボーンフレームを作る
 VMD_Frame interpolate_frame(const VMD_Frame& head_frame, const VMD_Frame& tail_frame, int frame_num, bool bezier=false);
 
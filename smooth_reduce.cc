@@ -1,74 +1,1024 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <Eigen/Core>
-#include <unsupported/Eigen/FFT>
 #include "VMD.h"
 #include "MMDFileIOUtil.h"
 #include "fpschanger.h"
+#include "interpolate.h"
+#include "lowpass.h"
 #include "smoothvmd.h"
 #include "reducevmd.h"
+#include "reduce_report.h"
+#include "smooth_reduce.h"
+#include "thread_pool.h"
 
 using namespace Eigen;
 using namespace MMDFileIOUtil;
 using namespace std;
 
-// VMDモーションの平滑化および間引きを行う
-bool smooth_and_reduce(VMD& vmd, float cutoff_freq, float threshold_pos, float threshold_rot,
-                       float threshold_morph, float srcfps, float tgtfps, bool bezier)
+// キーフレーム列vを名前ごとにまとめ、名前順(UTF-8)に並べ替える。各名前の中では元の順序を保つ
+// 並べ替えた後のvの[offsets[k], offsets[k+1])がk番目の名前names[k]のトラックになる
+// raw_name(キーフレーム)はShift-JISの名前を返す関数で、UTF-8への変換は名前の種類ごとに1回だけ行う
+template <typename T, typename RawName>
+static void group_by_name(vector<T>& v, RawName raw_name, vector<size_t>& offsets, vector<string>& names)
 {
-  cout << "vmd.frame.size(original): " << vmd.frame.size() << endl;
-  // キーフレームをボーンごとに分ける
-  map<string, vector<VMD_Frame>> frame_map;
-  for (unsigned int i = 0; i < vmd.frame.size(); i++) {
-    VMD_Frame frame = vmd.frame[i];
-    string name;
-    sjis_to_utf8(frame.bonename, name, frame.bonename_len);
-    frame_map[name].push_back(frame);
+  map<string, int> raw_ids;  // Shift-JISの名前 → 仮の番号
+  vector<string> utf8_names; // 仮の番号 → UTF-8の名前
+  vector<int> ids(v.size());
+  for (size_t i = 0; i < v.size(); i++) {
+    auto ins = raw_ids.insert(make_pair(raw_name(v[i]), int(utf8_names.size())));
+    if (ins.second) {
+      string name;
+      sjis_to_utf8(ins.first->first.c_str(), name, ins.first->first.size());
+      utf8_names.push_back(name);
+    }
+    ids[i] = ins.first->second;
+  }
+
+  // UTF-8の名前順にトラック番号を振り直す(同じUTF-8の名前になるものは1つのトラックにまとめる)
+  map<string, int> tracks;
+  for (const string& name : utf8_names) {
+    tracks.insert(make_pair(name, 0));
+  }
+  int ntrack = 0;
+  names.clear();
+  for (auto& t : tracks) {
+    t.second = ntrack++;
+    names.push_back(t.first);
+  }
+  vector<int> track_of(utf8_names.size());
+  for (size_t k = 0; k < utf8_names.size(); k++) {
+    track_of[k] = tracks[utf8_names[k]];
   }
-  // ボーンごとに平滑化と間引きを行い、vmdのボーンキーフレームを入れ替える
-  vmd.frame.clear();
-  for (auto iter = frame_map.begin(); iter != frame_map.end(); iter++) {
-    vector<VMD_Frame>& fv = iter->second;
-    if (fv.size() > 2) {
-      smooth_bone_frame(fv, cutoff_freq, bezier);
-      if (srcfps != tgtfps) {
-        fv = change_fps_bone(fv, srcfps, tgtfps, bezier);
+
+  // 計数ソートで並べ替える
+  offsets.assign(ntrack + 1, 0);
+  for (size_t i = 0; i < v.size(); i++) {
+    offsets[track_of[ids[i]] + 1]++;
+  }
+  for (int k = 0; k < ntrack; k++) {
+    offsets[k + 1] += offsets[k];
+  }
+  vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+  vector<T> sorted(v.size());
+  for (size_t i = 0; i < v.size(); i++) {
+    sorted[pos[track_of[ids[i]]]++] = move(v[i]);
+  }
+  v.swap(sorted);
+}
+
+// トラックを処理するための作業領域。トラックの処理は2つのバッファを交互に使って行う
+// 平滑化のフィルタは、フレームレートを変えた後にかける(decimate_first)なら出力のフレームレートで、
+// そうでなければ入力のフレームレートで設計する
+struct TrackWork {
+  TrackWork(const SmoothReduceParam& param)
+    : filter(param.cutoff_freq, param.filter, param.decimate_first ? param.tgtfps : param.srcfps),
+      antialias(antialias_ratio * param.tgtfps, FilterType::FIR, param.srcfps) { }
+  // 間引く前にかけるアンチエイリアスフィルタのカットオフ周波数(出力のフレームレートに対する比)
+  // ナイキスト周波数(0.5)より少し低くして、遷移帯域の分だけ余裕を持たせる
+  static constexpr float antialias_ratio = 0.4;
+  LowpassFilter filter;
+  LowpassFilter antialias;
+  vector<VMD_Frame> bone[2];
+  vector<VMD_Morph> morph[2];
+  ReduceHierarchy bone_hierarchy;
+  vector<float> morph_significance;
+  vector<float> significance_buf; // level_scaleで重要度を並べ替える作業領域
+};
+
+// 作業領域を使い回すためのもの。間引きはタスクの中で他のタスクを待ち、その間に同じスレッドで別のトラックを処理することが
+// あるので、作業領域はスレッドごとに割り当てず、使うたびに空いているものを借りる
+class TrackWorkStore {
+public:
+  explicit TrackWorkStore(const SmoothReduceParam& param) : param(param) { }
+
+  unique_ptr<TrackWork> acquire() {
+    {
+      lock_guard<mutex> lock(mtx);
+      if (!free_works.empty()) {
+        unique_ptr<TrackWork> work = move(free_works.back());
+        free_works.pop_back();
+        return work;
       }
-      fv = reduce_bone_frame(fv, 0, fv.size() - 1, threshold_pos, threshold_rot, bezier);
     }
-    for (unsigned int i = 0; i < fv.size(); i++) {
-      vmd.frame.push_back(fv[i]);
+    return unique_ptr<TrackWork>(new TrackWork(param));
+  }
+
+  void release(unique_ptr<TrackWork> work) {
+    lock_guard<mutex> lock(mtx);
+    free_works.push_back(move(work));
+  }
+
+private:
+  const SmoothReduceParam& param;
+  mutex mtx;
+  vector<unique_ptr<TrackWork>> free_works;
+};
+
+// 間引きの階層を求めるときの閾値の倍率の下限(levelsのうち最小のもの)
+static float hierarchy_min_scale(const SmoothReduceParam& param)
+{
+  return *min_element(param.levels.begin(), param.levels.end());
+}
+
+// levelsの出力で、閾値をscale倍したときに残るキーフレーム(重要度がscaleより大きいもの)がmax_keys個を超えるなら、
+// max_keys個以下になるまでscaleを上げて返す。max_keysが0以下なら上限はないのでscaleのまま
+// 閾値が負で重要度がすべて無限大のとき(間引かない)は、上限に収まる倍率がないので無限大を返す
+static float level_scale(const vector<float>& significance, float scale, int max_keys, vector<float>& buf)
+{
+  if (max_keys <= 0 ||
+      count_if(significance.begin(), significance.end(), [scale](float s) { return s > scale; }) <= max_keys) {
+    return scale;
+  }
+  // max_keys + 1番目に大きい重要度より大きいものだけを残す(同じ重要度のものは一緒に残すか一緒に除く)
+  buf = significance;
+  nth_element(buf.begin(), buf.begin() + max_keys, buf.end(), greater<float>());
+  return buf[max_keys];
+}
+
+// 間引く前に値がほぼ一定の所をまとめるときの、値の差の上限の閾値に対する比
+// まとめたことによる誤差は差の2倍以下なので、閾値に比べて十分小さくなる
+static const float plateau_ratio = 1.0 / 32;
+
+// 値がほぼ一定の所をまとめるときの閾値の倍率(間引く閾値の倍率のうち最小のもの)
+static float plateau_scale(const SmoothReduceParam& param)
+{
+  if (param.levels.empty()) {
+    return 1.0;
+  }
+  return min(1.0f, *min_element(param.levels.begin(), param.levels.end()));
+}
+
+// 平滑化したボーンキーフレーム列vの、値がほぼ一定の所をまとめてoutに入れる。閾値が負なら間引かないので、そのまま入れる
+static void collapse_bone_track(const vector<VMD_Frame>& v, const SmoothReduceParam& param, float scale, vector<VMD_Frame>& out)
+{
+  if (param.threshold_pos < 0 || param.threshold_rot < 0) {
+    out = v;
+    return;
+  }
+  float ratio = plateau_ratio * scale;
+  float threshold_rot = param.threshold_rot;
+  if (!param.world_points.empty()) {
+    // 点のずれの閾値を、最も遠い点がそれだけずれる回転の角度[degree]にする
+    float max_norm = 0;
+    for (const Vector3f& p : param.world_points) {
+      max_norm = max(max_norm, p.norm());
     }
+    threshold_rot = (max_norm > 0) ? threshold_rot / max_norm * 180 / M_PI : 0;
   }
-  cout << "vmd.frame.size(reduced): " << vmd.frame.size() << endl;
-  
+  collapse_bone_plateaus(v, param.threshold_pos * ratio, threshold_rot * ratio, out);
+}
+
+// 平滑化した表情キーフレーム列vの、値がほぼ一定の所をまとめてoutに入れる
+static void collapse_morph_track(const vector<VMD_Morph>& v, const SmoothReduceParam& param, float scale, vector<VMD_Morph>& out)
+{
+  if (param.threshold_morph < 0) {
+    out = v;
+    return;
+  }
+  collapse_morph_plateaus(v, param.threshold_morph * plateau_ratio * scale, out);
+}
+
+// 値がほぼ一定の所をまとめたボーンキーフレーム列vを、閾値(max_keysが正ならその上限も)で間引いてoutに入れる
+static void reduce_bone_track(const vector<VMD_Frame>& v, int max_keys, const SmoothReduceParam& param, ThreadPool* pool,
+                              vector<VMD_Frame>& out)
+{
+  out.clear();
+  if (v.size() <= 2) {
+    out = v;
+    return;
+  }
+  int tail = v.size() - 1;
+  if (max_keys > 0) {
+    reduce_bone_frame_budget(v, 0, tail, param.threshold_pos, param.threshold_rot, param.bezier, max_keys, out,
+                             param.metric, param.world_points);
+  } else {
+    reduce_bone_frame(v, 0, tail, param.threshold_pos, param.threshold_rot, param.bezier, out, pool,
+                      param.metric, param.world_points);
+  }
+}
+
+// 平滑化したボーンキーフレーム列を間引いてouts[0]に入れる
+// levelsが指定されていれば、間引きの階層を1回だけ求め、閾値をlevels[k]倍したものをouts[k + 1]に入れる
+// 階層の分割点の選び方はreduce_bone_frameと違うので、outs[0]はlevelsによらずlevelsなしのときと同じように求める
+// max_keysが正ならlevelsの出力もmax_keys個以下にする(level_scale)。閾値が負で上限を超えるときは、
+// 閾値を0として上限まで残したouts[0]と同じものにする(0は何倍しても0なので)
+// 値がほぼ一定の所はまとめてから間引く(まとめたものはwork.bone[1]に入れるので、smoothedはwork.bone[1]以外にする)
+static void reduce_bone_outputs(const vector<VMD_Frame>& smoothed, int max_keys, const SmoothReduceParam& param,
+                                TrackWork& work, ThreadPool* pool, vector<vector<VMD_Frame>>& outs)
+{
+  collapse_bone_track(smoothed, param, 1.0, work.bone[1]);
+  reduce_bone_track(work.bone[1], max_keys, param, pool, outs[0]);
+  if (param.levels.empty()) {
+    return;
+  }
+
+  float scale = plateau_scale(param);
+  if (scale < 1.0) {
+    collapse_bone_track(smoothed, param, scale, work.bone[1]);
+  }
+  const vector<VMD_Frame>& v = work.bone[1];
+  if (v.size() <= 2) {
+    for (size_t k = 0; k < param.levels.size(); k++) {
+      outs[k + 1] = v;
+    }
+    return;
+  }
+  build_bone_hierarchy(v, param.threshold_pos, param.threshold_rot, param.bezier,
+                       hierarchy_min_scale(param), work.bone_hierarchy, pool, param.metric,
+                       param.world_points);
+  for (size_t k = 0; k < param.levels.size(); k++) {
+    float level = level_scale(work.bone_hierarchy.significance, param.levels[k], max_keys, work.significance_buf);
+    if (isinf(level)) {
+      outs[k + 1] = outs[0];
+      continue;
+    }
+    outs[k + 1].clear();
+    select_bone_frame(v, work.bone_hierarchy, level, param.bezier, outs[k + 1]);
+  }
+}
+
+// 値がほぼ一定の所をまとめた表情キーフレーム列vを、閾値(max_keysが正ならその上限も)で間引いてoutに入れる
+static void reduce_morph_track(const vector<VMD_Morph>& v, int max_keys, const SmoothReduceParam& param, ThreadPool* pool,
+                               vector<VMD_Morph>& out)
+{
+  out.clear();
+  if (v.size() <= 2) {
+    out = v;
+    return;
+  }
+  int tail = v.size() - 1;
+  if (max_keys > 0) {
+    reduce_morph_frame_budget(v, 0, tail, param.threshold_morph, max_keys, out, param.metric);
+  } else {
+    reduce_morph_frame(v, 0, tail, param.threshold_morph, out, pool, param.metric);
+  }
+}
+
+// 平滑化した表情キーフレーム列を間引いてouts[0]に入れる。levelsと値がほぼ一定の所の扱いはreduce_bone_outputsと同じ
+static void reduce_morph_outputs(const vector<VMD_Morph>& smoothed, int max_keys, const SmoothReduceParam& param,
+                                 TrackWork& work, ThreadPool* pool, vector<vector<VMD_Morph>>& outs)
+{
+  collapse_morph_track(smoothed, param, 1.0, work.morph[1]);
+  reduce_morph_track(work.morph[1], max_keys, param, pool, outs[0]);
+  if (param.levels.empty()) {
+    return;
+  }
+
+  float scale = plateau_scale(param);
+  if (scale < 1.0) {
+    collapse_morph_track(smoothed, param, scale, work.morph[1]);
+  }
+  const vector<VMD_Morph>& v = work.morph[1];
+  if (v.size() <= 2) {
+    for (size_t k = 0; k < param.levels.size(); k++) {
+      outs[k + 1] = v;
+    }
+    return;
+  }
+  build_morph_hierarchy(v, param.threshold_morph, hierarchy_min_scale(param), work.morph_significance, pool,
+                        param.metric);
+  for (size_t k = 0; k < param.levels.size(); k++) {
+    float level = level_scale(work.morph_significance, param.levels[k], max_keys, work.significance_buf);
+    if (isinf(level)) {
+      outs[k + 1] = outs[0];
+      continue;
+    }
+    outs[k + 1].clear();
+    select_morph_frame(v, work.morph_significance, level, outs[k + 1]);
+  }
+}
+
+// 1つのボーンの、隙間の短い区間[first, last)のキーフレームを平滑化してwork.bone[0]に入れる
+// 区間はstartフレーム目から始める
+static void smooth_bone_segment(const VMD_Frame* first, const VMD_Frame* last, uint32_t start,
+                                const SmoothReduceParam& param, TrackWork& work)
+{
+  vector<VMD_Frame>* buf = work.bone;
+  fill_bone_frame(first, last, start, param.bezier, buf[0]); // キーフレームの隙間をなくす
+  despike_bone_frame(buf[0], work.filter, param.despike);
+  if (param.decimate_first && param.srcfps != param.tgtfps) {
+    // 先にフレームレートを変えてから平滑化する。フレーム数が減る分、平滑化と間引きが速くなる
+    if (param.srcfps > param.tgtfps) {
+      smooth_bone_frame(buf[0], work.antialias);
+    }
+    change_fps_bone(buf[0], param.srcfps, param.tgtfps, param.bezier, buf[1]);
+    buf[0].swap(buf[1]);
+    smooth_bone_frame(buf[0], work.filter);
+  } else {
+    smooth_bone_frame(buf[0], work.filter);
+    if (param.srcfps != param.tgtfps) {
+      change_fps_bone(buf[0], param.srcfps, param.tgtfps, param.bezier, buf[1]);
+      buf[0].swap(buf[1]);
+    }
+  }
+}
+
+// 1つのボーンの、隙間の短い区間[first, last)のキーフレームを平滑化して間引き、outに入れる
+// 区間はstartフレーム目から始める。max_keysが正なら、キーフレームをmax_keys個以下に間引く
+// outsの大きさはlevelsの数+1で、levelsごとの結果もここに入る。長いトラックの間引きはpoolで並列に行う
+static void process_bone_segment(const VMD_Frame* first, const VMD_Frame* last, uint32_t start, int max_keys,
+                                 const SmoothReduceParam& param, TrackWork& work, ThreadPool* pool, vector<vector<VMD_Frame>>& outs)
+{
+  smooth_bone_segment(first, last, start, param, work);
+  reduce_bone_outputs(work.bone[0], max_keys, param, work, pool, outs);
+}
+
+// 1つのモーフの、隙間の短い区間[first, last)のキーフレームを平滑化してwork.morph[0]に入れる
+// 区間はstartフレーム目から始める
+static void smooth_morph_segment(const VMD_Morph* first, const VMD_Morph* last, uint32_t start,
+                                 const SmoothReduceParam& param, TrackWork& work)
+{
+  vector<VMD_Morph>* buf = work.morph;
+  fill_morph_frame(first, last, start, buf[0]); // キーフレームの隙間をなくす
+  despike_morph_frame(buf[0], work.filter, param.despike);
+  if (param.decimate_first && param.srcfps != param.tgtfps) {
+    // 先にフレームレートを変えてから平滑化する
+    if (param.srcfps > param.tgtfps) {
+      smooth_morph_frame(buf[0], work.antialias);
+    }
+    change_fps_morph(buf[0], param.srcfps, param.tgtfps, buf[1]);
+    buf[0].swap(buf[1]);
+    smooth_morph_frame(buf[0], work.filter);
+  } else {
+    smooth_morph_frame(buf[0], work.filter);
+    if (param.srcfps != param.tgtfps) {
+      change_fps_morph(buf[0], param.srcfps, param.tgtfps, buf[1]);
+      buf[0].swap(buf[1]);
+    }
+  }
+}
+
+// 1つのモーフの、隙間の短い区間[first, last)のキーフレームを平滑化して間引き、outに入れる
+// 区間はstartフレーム目から始める。max_keysが正なら、キーフレームをmax_keys個以下に間引く
+// outsの大きさはlevelsの数+1で、levelsごとの結果もここに入る。長いトラックの間引きはpoolで並列に行う
+static void process_morph_segment(const VMD_Morph* first, const VMD_Morph* last, uint32_t start, int max_keys,
+                                  const SmoothReduceParam& param, TrackWork& work, ThreadPool* pool, vector<vector<VMD_Morph>>& outs)
+{
+  smooth_morph_segment(first, last, start, param, work);
+  reduce_morph_outputs(work.morph[0], max_keys, param, work, pool, outs);
+}
+
+// トラックを隙間で分けた区間
+struct Segment {
+  size_t head;    // 区間のキーフレームは並べ替えた後のキーフレーム列の[head, tail)
+  size_t tail;
+  uint32_t start; // 区間を始めるフレーム
+  int max_keys;   // キーフレーム数の上限。0なら閾値だけで間引く
+  size_t track;   // トラックの番号
+  bool copy;      // キーフレームが2個以下のトラックなので、処理せずそのまま残す
+  bool drop = false; // トラックのキーフレーム数の上限が区間の数に対して少ないので、この区間は出力しない
+};
+
+// 区間の長さspans[j]に比例して、合計がmax_keys以下になるよう区間ごとのキーフレーム数の上限を割り振る
+// 各区間にはまず両端の2個を割り当て、残りを最大剰余法で割り振る(切り捨てた端数の大きい区間から1個ずつ足す)
+// 2個ずつ割り当てられないほど区間が多いときは、長い区間から順に2個(両端だけ)を割り当て、残りの区間は0個にする
+static vector<int> split_key_budget(const vector<int64_t>& spans, int max_keys)
+{
+  int n = spans.size();
+  vector<int> budget(n, 0);
+  vector<int> order(n);
+  for (int j = 0; j < n; j++) {
+    order[j] = j;
+  }
+  if (int64_t(2) * n > max_keys) {
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return spans[a] > spans[b]; });
+    for (int j = 0; j < max_keys / 2; j++) {
+      budget[order[j]] = 2;
+    }
+    return budget;
+  }
+
+  int64_t total = 0;
+  for (int64_t span : spans) {
+    total += span;
+  }
+  int64_t rest = max_keys - int64_t(2) * n; // 両端の分を除いた残り
+  int64_t left = rest;                       // 切り捨てで割り振れなかった数
+  vector<int64_t> remainder(n);
+  for (int j = 0; j < n; j++) {
+    int64_t q = rest * spans[j];
+    budget[j] = 2 + q / total;
+    remainder[j] = q % total;
+    left -= q / total;
+  }
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return remainder[a] > remainder[b]; });
+  for (int j = 0; j < left; j++) {
+    budget[order[j]]++;
+  }
+  return budget;
+}
+
+// 各トラックをフレーム番号順に並べ、max_gapより長い隙間で区間に分けてsegmentsにトラック順・区間順に入れる。max_gapが0以下なら分けない
+// トラックごとのキーフレーム数の上限max_keysは、合計がmax_keysを超えないよう区間の長さに比例して区間に割り振る(split_key_budget)
+template <typename T, typename FrameNumber>
+static void make_segments(vector<T>& v, const vector<size_t>& offsets, int max_gap, int max_keys,
+                          FrameNumber frame_number, vector<Segment>& segments)
+{
+  segments.clear();
+  auto span = [&](size_t head, size_t tail) {
+    return int64_t(frame_number(v[tail - 1])) - frame_number(v[head]) + 1;
+  };
+  for (size_t k = 0; k + 1 < offsets.size(); k++) {
+    T* first = v.data() + offsets[k];
+    T* last = v.data() + offsets[k + 1];
+    sort(first, last);
+    if (last - first <= 2) {
+      segments.push_back(Segment{offsets[k], offsets[k + 1], 0, 0, k, true});
+      continue;
+    }
+    size_t s = segments.size();
+    size_t head = offsets[k];
+    for (size_t i = head + 1; i < offsets[k + 1]; i++) {
+      if (max_gap > 0 && int64_t(frame_number(v[i])) - frame_number(v[i - 1]) > max_gap) {
+        segments.push_back(Segment{head, i, 0, 0, k, false});
+        head = i;
+      }
+    }
+    segments.push_back(Segment{head, offsets[k + 1], 0, 0, k, false});
+
+    vector<int> budget;
+    if (max_keys > 0) {
+      vector<int64_t> spans;
+      for (size_t j = s; j < segments.size(); j++) {
+        spans.push_back(span(segments[j].head, segments[j].tail));
+      }
+      budget = split_key_budget(spans, max_keys);
+    }
+    for (size_t j = s; j < segments.size(); j++) {
+      Segment& seg = segments[j];
+      // トラックの最初の区間は0フレーム目から始める(従来どおり)。ただし先頭の隙間が長い場合と、
+      // 2つ目以降の区間は、その区間の最初のキーフレームから始める
+      seg.start = frame_number(v[seg.head]);
+      if (seg.head == offsets[k] && (max_gap <= 0 || int64_t(seg.start) <= max_gap)) {
+        seg.start = 0;
+      }
+      if (max_keys > 0) {
+        seg.max_keys = budget[j - s];
+        seg.drop = (seg.max_keys == 0);
+      }
+    }
+  }
+}
+
+// キーフレーム数の上限が区間の数に対して少なく、出力しない区間があるトラックを知らせる
+static void warn_dropped_segments(const vector<Segment>& segments, const vector<string>& names, int max_keys)
+{
+  map<size_t, int> dropped; // トラックの番号 → 出力しない区間の数
+  for (const Segment& seg : segments) {
+    if (seg.drop) {
+      dropped[seg.track]++;
+    }
+  }
+  for (const auto& d : dropped) {
+    cerr << "max_keys " << max_keys << " is too small for the segments of " << names[d.first]
+         << ": dropped " << d.second << " short segment(s)" << endl;
+  }
+}
+
+// 区間ごとにジョブを作る。区間の結果はresults[区間][出力]に入る。出力はnoutput個(メインとlevelsの分)
+// キーフレームが2個以下のトラックは処理せずそのまま残す。skip_track[トラック]が1のトラックはジョブを作らない
+// ジョブはprocess(区間の番号, first, last, start, max_keys, outs)を呼ぶ
+template <typename T, typename Process>
+static void make_segment_jobs(const vector<T>& v, const vector<Segment>& segments, const vector<uint8_t>& skip_track,
+                              Process process, vector<vector<vector<T>>>& results,
+                              vector<pair<size_t, function<void()>>>& jobs)
+{
+  for (size_t s = 0; s < segments.size(); s++) {
+    const Segment& seg = segments[s];
+    const T* first = v.data() + seg.head;
+    const T* last = v.data() + seg.tail;
+    vector<vector<T>>& outs = results[s];
+    if (seg.copy) {
+      for (vector<T>& out : outs) {
+        out.assign(first, last);
+      }
+      continue;
+    }
+    if (skip_track[seg.track] || seg.drop) {
+      continue;
+    }
+    uint32_t start = seg.start;
+    int keys = seg.max_keys;
+    jobs.push_back(make_pair(last - first, [=, &outs]() { process(s, first, last, start, keys, outs); }));
+  }
+}
+
+// 再構成誤差を求めるために残しておく、区間ごとの間引く前の(平滑化した)キーフレーム列
+struct SmoothedSegments {
+  vector<vector<VMD_Frame>> bones;
+  vector<vector<VMD_Morph>> morphs;
+};
+
+// 一緒に間引くトラックの組の区間
+struct JointSegments {
+  vector<size_t> bones;  // ボーンの区間の番号
+  vector<size_t> morphs; // モーフの区間の番号
+  size_t ntrack;         // 組のトラック数
+};
+
+// 一緒に間引くトラックの組の区間を平滑化し、すべてのトラックで同じフレームの範囲になっている区間は
+// reduce_joint_frameでまとめて間引く。そうでない区間(顔を見失った範囲がトラックで違う場合など)はトラックごとに間引く
+// smoothedがあれば、平滑化した区間をそこに残す
+static void process_joint_segments(const vector<VMD_Frame>& frames, const vector<Segment>& frame_segments,
+                                   const vector<VMD_Morph>& morphs, const vector<Segment>& morph_segments,
+                                   const JointSegments& joint, const SmoothReduceParam& param, TrackWork& work, ThreadPool* pool,
+                                   vector<vector<vector<VMD_Frame>>>& frame_results, vector<vector<vector<VMD_Morph>>>& morph_results,
+                                   SmoothedSegments* smoothed)
+{
+  // 平滑化した区間を、最初のフレームとフレーム数で分類する
+  map<pair<uint32_t, size_t>, pair<vector<size_t>, vector<size_t>>> ranges; // 範囲 → ボーンとモーフの区間(jointの中の番号)
+  vector<vector<VMD_Frame>> bone_buf(joint.bones.size());
+  for (size_t k = 0; k < joint.bones.size(); k++) {
+    const Segment& seg = frame_segments[joint.bones[k]];
+    smooth_bone_segment(frames.data() + seg.head, frames.data() + seg.tail, seg.start, param, work);
+    bone_buf[k].swap(work.bone[0]);
+    if (smoothed) {
+      smoothed->bones[joint.bones[k]] = bone_buf[k];
+    }
+    ranges[make_pair(bone_buf[k].front().number, bone_buf[k].size())].first.push_back(k);
+  }
+  vector<vector<VMD_Morph>> morph_buf(joint.morphs.size());
+  for (size_t k = 0; k < joint.morphs.size(); k++) {
+    const Segment& seg = morph_segments[joint.morphs[k]];
+    smooth_morph_segment(morphs.data() + seg.head, morphs.data() + seg.tail, seg.start, param, work);
+    morph_buf[k].swap(work.morph[0]);
+    if (smoothed) {
+      smoothed->morphs[joint.morphs[k]] = morph_buf[k];
+    }
+    ranges[make_pair(morph_buf[k].front().frame, morph_buf[k].size())].second.push_back(k);
+  }
+
+  for (auto& range : ranges) {
+    const vector<size_t>& b = range.second.first;
+    const vector<size_t>& m = range.second.second;
+    if (b.size() + m.size() == joint.ntrack && range.first.second > 2) {
+      // すべてのトラックが揃っている
+      vector<const vector<VMD_Frame>*> bone_in;
+      vector<vector<VMD_Frame>*> bone_out;
+      for (size_t k : b) {
+        bone_in.push_back(&bone_buf[k]);
+        bone_out.push_back(&frame_results[joint.bones[k]][0]);
+        bone_out.back()->clear();
+      }
+      vector<const vector<VMD_Morph>*> morph_in;
+      vector<vector<VMD_Morph>*> morph_out;
+      for (size_t k : m) {
+        morph_in.push_back(&morph_buf[k]);
+        morph_out.push_back(&morph_results[joint.morphs[k]][0]);
+        morph_out.back()->clear();
+      }
+      reduce_joint_frame(bone_in, morph_in, param.threshold_pos, param.threshold_rot, param.threshold_morph, param.bezier,
+                         bone_out, morph_out, pool, param.metric);
+      continue;
+    }
+    for (size_t k : b) {
+      reduce_bone_outputs(bone_buf[k], 0, param, work, pool, frame_results[joint.bones[k]]);
+    }
+    for (size_t k : m) {
+      reduce_morph_outputs(morph_buf[k], 0, param, work, pool, morph_results[joint.morphs[k]]);
+    }
+  }
+}
+
+// 閾値の倍率を探すときに、区間ごとに平滑化したキーフレーム列と間引きの階層を残しておくもの
+struct SearchSegments {
+  vector<vector<VMD_Frame>> bones;       // 平滑化したボーンの区間(値がほぼ一定の所をまとめたもの)
+  vector<ReduceHierarchy> bone_hierarchy;
+  vector<uint8_t> bezier;                // ボーンの区間の補間曲線を最適化したか
+  vector<vector<VMD_Morph>> morphs;      // 平滑化したモーフの区間(値がほぼ一定の所をまとめたもの)
+  vector<vector<float>> morph_significance;
+};
+
+// 閾値の倍率を探すときに、間引きの階層を求める倍率の下限。これより小さい倍率にはしない
+static const float search_min_scale = 1.0 / 32;
+
+// 区間ごとの重要度significancesから、閾値をscale倍したときに残るキーフレーム(重要度がscaleより大きいもの)の
+// 合計がkeys個に近くなる倍率scaleを求める。残るキーフレームの数は倍率について単調なので、
+// 重要度を大きい順に並べたkeys番目の値が答えになる(倍率を二分探索するのと同じ結果を、並べ替えの一部だけで求める)
+static float search_scale(const vector<const vector<float>*>& significances, int64_t keys)
+{
+  vector<float> finite;
+  for (const vector<float>* sig : significances) {
+    for (float x : *sig) {
+      if (x == numeric_limits<float>::infinity()) {
+        keys--; // 両端などの必ず残るキーフレーム
+      } else if (x > search_min_scale) {
+        finite.push_back(x);
+      }
+    }
+  }
+  if (keys >= int64_t(finite.size())) {
+    return search_min_scale;
+  }
+  if (keys <= 0) {
+    return finite.empty() ? search_min_scale : *max_element(finite.begin(), finite.end());
+  }
+  nth_element(finite.begin(), finite.begin() + keys, finite.end(), greater<float>());
+  return max(finite[keys], search_min_scale);
+}
+
+// 平滑化して求めた間引きの階層search.bone_hierarchy, search.morph_significanceから、トラックあたり毎秒の
+// キーフレーム数がparam.target_kpsになるような閾値の倍率を、ボーンと表情それぞれで求めて間引く
+// 結果はframe_results[区間][0], morph_results[区間][0]に入れる。処理しない(そのまま残す)区間はすでに入っているものとする
+static void reduce_to_target(const vector<Segment>& frame_segments, const vector<Segment>& morph_segments,
+                             const vector<VMD_Frame>& frames, const vector<VMD_Morph>& morphs,
+                             const SmoothReduceParam& param, const SearchSegments& search,
+                             vector<vector<vector<VMD_Frame>>>& frame_results, vector<vector<vector<VMD_Morph>>>& morph_results)
+{
+  // トラックの長さの合計[秒]と、処理しない区間のキーフレーム数
+  double bone_seconds = 0.0;
+  int64_t bone_keys = 0;
+  vector<const vector<float>*> bone_significances;
+  for (size_t s = 0; s < frame_segments.size(); s++) {
+    const Segment& seg = frame_segments[s];
+    if (seg.copy) {
+      bone_seconds += (frames[seg.tail - 1].number - frames[seg.head].number + 1) / param.srcfps;
+      bone_keys += seg.tail - seg.head;
+    } else {
+      bone_seconds += (search.bones[s].back().number - search.bones[s].front().number + 1) / param.tgtfps;
+      bone_significances.push_back(&search.bone_hierarchy[s].significance);
+    }
+  }
+  double morph_seconds = 0.0;
+  int64_t morph_keys = 0;
+  vector<const vector<float>*> morph_significances;
+  for (size_t s = 0; s < morph_segments.size(); s++) {
+    const Segment& seg = morph_segments[s];
+    if (seg.copy) {
+      morph_seconds += (morphs[seg.tail - 1].frame - morphs[seg.head].frame + 1) / param.srcfps;
+      morph_keys += seg.tail - seg.head;
+    } else {
+      morph_seconds += (search.morphs[s].back().frame - search.morphs[s].front().frame + 1) / param.tgtfps;
+      morph_significances.push_back(&search.morph_significance[s]);
+    }
+  }
+
+  float bone_scale = search_scale(bone_significances, int64_t(param.target_kps * bone_seconds + 0.5) - bone_keys);
+  float morph_scale = search_scale(morph_significances, int64_t(param.target_kps * morph_seconds + 0.5) - morph_keys);
+  for (size_t s = 0; s < frame_segments.size(); s++) {
+    if (!frame_segments[s].copy) {
+      vector<VMD_Frame>& out = frame_results[s][0];
+      out.clear();
+      select_bone_frame(search.bones[s], search.bone_hierarchy[s], bone_scale, search.bezier[s], out);
+      bone_keys += out.size();
+    }
+  }
+  for (size_t s = 0; s < morph_segments.size(); s++) {
+    if (!morph_segments[s].copy) {
+      vector<VMD_Morph>& out = morph_results[s][0];
+      out.clear();
+      select_morph_frame(search.morphs[s], search.morph_significance[s], morph_scale, out);
+      morph_keys += out.size();
+    }
+  }
+
+  cout << "target keyframes per second: " << param.target_kps << endl;
+  cout << "bone: scale " << bone_scale << ", threshold(position) " << param.threshold_pos * bone_scale
+       << ", threshold(rotation) " << param.threshold_rot * bone_scale
+       << ", keyframes per second " << (bone_seconds > 0 ? bone_keys / bone_seconds : 0.0) << endl;
+  cout << "morph: scale " << morph_scale << ", threshold(morph) " << param.threshold_morph * morph_scale
+       << ", keyframes per second " << (morph_seconds > 0 ? morph_keys / morph_seconds : 0.0) << endl;
+}
+
+template <typename T>
+static void concat_tracks(vector<T>& v, vector<vector<vector<T>>>& results, int k)
+{
+  size_t total = 0;
+  for (const vector<vector<T>>& r : results) {
+    total += r[k].size();
+  }
+  v.clear();
+  v.reserve(total);
+  for (vector<vector<T>>& r : results) {
+    v.insert(v.end(), r[k].begin(), r[k].end());
+  }
+}
+
+// トラックごとの間引きの設定param.policiesを反映したパラメータを、names[k]のトラックについてk番目に入れて返す
+static vector<SmoothReduceParam> track_params(const SmoothReduceParam& param, const vector<string>& names)
+{
+  vector<SmoothReduceParam> params(names.size(), param);
+  for (size_t k = 0; k < names.size(); k++) {
+    auto iter = param.policies.find(names[k]);
+    if (iter == param.policies.end()) {
+      continue;
+    }
+    const TrackPolicy& policy = iter->second;
+    params[k].threshold_pos = policy.threshold_pos;
+    params[k].threshold_rot = policy.threshold_rot;
+    params[k].threshold_morph = policy.threshold_morph;
+    params[k].bezier = policy.bezier;
+    params[k].metric = policy.metric;
+    params[k].world_points = policy.world_points;
+  }
+  return params;
+}
+
+// 区間ごとの間引いた結果results[区間][0]を間引く前のキーフレーム列smoothed[区間]と比べて、トラックごとの誤差を
+// reportのoffset + トラックの番号の所に入れる。トラックごとのジョブをpoolで並列に実行して終わるまで待つ
+// eval(smoothed, keys, param, errs)はerrs(ボーンは位置と回転、表情は値)に各フレームの誤差を入れる
+template <typename T, typename Eval>
+static void report_tracks(const vector<Segment>& segments, const vector<string>& names, const vector<SmoothReduceParam>& params,
+                          const vector<vector<T>>& smoothed, const vector<vector<vector<T>>>& results, bool bone,
+                          Eval eval, size_t offset, ThreadPool& pool, vector<TrackReport>& report)
+{
+  TaskGroup group;
+  for (size_t k = 0; k < names.size(); k++) {
+    pool.submit(group, [&, k]() {
+        TrackReport& r = report[offset + k];
+        r.name = names[k];
+        r.bone = bone;
+        array<vector<float>, 2> errs;       // 区間の誤差
+        array<vector<float>, 2> track_errs; // トラック全体の誤差
+        for (size_t s = 0; s < segments.size(); s++) {
+          if (segments[s].track != k) {
+            continue;
+          }
+          const vector<T>& keys = results[s][0];
+          r.keys += keys.size();
+          if (segments[s].copy) {
+            // 処理せずそのまま残したトラック
+            r.frames += keys.size();
+            for (vector<float>& e : track_errs) {
+              e.insert(e.end(), keys.size(), 0.0);
+            }
+            continue;
+          }
+          r.frames += smoothed[s].size();
+          eval(smoothed[s], keys, params[k], errs);
+          for (int i = 0; i < 2; i++) {
+            track_errs[i].insert(track_errs[i].end(), errs[i].begin(), errs[i].end());
+          }
+        }
+        if (bone) {
+          r.pos = error_stats(track_errs[0]);
+          r.rot = error_stats(track_errs[1]);
+        } else {
+          r.morph = error_stats(track_errs[0]);
+        }
+      });
+  }
+  pool.wait(group);
+}
+
+// VMDモーションの平滑化および間引きを行う
+// トラック(およびトラックを隙間で分けた区間)ごとの処理は互いに独立なので、スレッドプールで並列に行う
+// param.levelsが指定されていれば、閾値をlevels[k]倍して間引いたものをlevel_vmds[k]に入れる
+// reportがあれば、メインの出力のトラックごとの誤差を入れる(間引く前の平滑化した区間を残しておいて比べる)
+static bool smooth_and_reduce_tracks(VMD& vmd, const SmoothReduceParam& param, vector<VMD>& level_vmds,
+                                     vector<TrackReport>* report)
+{
+  const int noutput = param.levels.size() + 1;
+  ThreadPool pool(param.num_threads);
+  // FFTのプランと作業領域は、同時に処理しているトラックの数だけ作って使い回す
+  TrackWorkStore works(param);
+  TaskGroup group;
+  // 長いトラックほど時間がかかるので、最後に長いトラックが1つだけ残らないよう長い順に登録する
+  vector<pair<size_t, function<void()>>> jobs;
+
+  cout << "vmd.frame.size(original): " << vmd.frame.size() << endl;
+  // キーフレームをボーンごとにまとめて区間に分ける
+  vector<size_t> frame_offsets;
+  vector<string> frame_names;
+  group_by_name(vmd.frame, [](const VMD_Frame& f) {
+      return string(f.bonename, strnlen(f.bonename, VMD_Frame::bonename_len));
+    }, frame_offsets, frame_names);
+  vector<Segment> frame_segments;
+  make_segments(vmd.frame, frame_offsets, param.max_gap, param.max_keys, [](const VMD_Frame& f) { return f.number; }, frame_segments);
+  warn_dropped_segments(frame_segments, frame_names, param.max_keys);
+  vector<vector<vector<VMD_Frame>>> frame_results(frame_segments.size(), vector<vector<VMD_Frame>>(noutput));
+  vector<SmoothReduceParam> frame_params = track_params(param, frame_names);
+
   cout << "vmd.morph.size(original): " << vmd.morph.size() << endl;
-  // キーフレームをモーフごとに分ける
-  map<string, vector<VMD_Morph>> morph_map;
-  for (unsigned int i = 0; i < vmd.morph.size(); i++) {
-    VMD_Morph morph = vmd.morph[i];
-    string name;
-    sjis_to_utf8(morph.name, name, morph.name_len);
-    morph_map[name].push_back(morph);
+  // キーフレームをモーフごとにまとめて区間に分ける
+  vector<size_t> morph_offsets;
+  vector<string> morph_names;
+  group_by_name(vmd.morph, [](const VMD_Morph& m) {
+      return string(m.name, strnlen(m.name, VMD_Morph::name_len));
+    }, morph_offsets, morph_names);
+  vector<Segment> morph_segments;
+  make_segments(vmd.morph, morph_offsets, param.max_gap, param.max_keys, [](const VMD_Morph& m) { return m.frame; }, morph_segments);
+  warn_dropped_segments(morph_segments, morph_names, param.max_keys);
+  vector<vector<vector<VMD_Morph>>> morph_results(morph_segments.size(), vector<vector<VMD_Morph>>(noutput));
+  vector<SmoothReduceParam> morph_params = track_params(param, morph_names);
+
+  SmoothedSegments smoothed;
+  if (report) {
+    smoothed.bones.resize(frame_segments.size());
+    smoothed.morphs.resize(morph_segments.size());
+  }
+
+  // 一緒に間引くトラックの組を探す。閾値だけで間引くときに使い、2つ以上のトラックがある組だけを対象にする
+  // 1つのトラックは最初に現れた組にだけ入れる。トラックごとの間引きの設定があるトラックは入れない
+  vector<uint8_t> joint_frame(frame_names.size(), 0);
+  vector<uint8_t> joint_morph(morph_names.size(), 0);
+  vector<JointSegments> joints;
+  // 目標のキーフレーム数があれば、すべての区間の間引きの階層を求めてから閾値の倍率を探す
+  bool search_target = param.target_kps > 0 && param.levels.empty() && param.max_keys <= 0;
+  if (param.levels.empty() && param.max_keys <= 0 && !search_target) {
+    for (const vector<string>& names : param.joint_groups) {
+      vector<size_t> bones, morphs;
+      for (const string& name : names) {
+        if (param.policies.count(name)) {
+          continue;
+        }
+        auto b = lower_bound(frame_names.begin(), frame_names.end(), name);
+        if (b != frame_names.end() && *b == name && !joint_frame[b - frame_names.begin()]) {
+          bones.push_back(b - frame_names.begin());
+        }
+        auto m = lower_bound(morph_names.begin(), morph_names.end(), name);
+        if (m != morph_names.end() && *m == name && !joint_morph[m - morph_names.begin()]) {
+          morphs.push_back(m - morph_names.begin());
+        }
+      }
+      if (bones.size() + morphs.size() < 2) {
+        continue;
+      }
+      JointSegments joint;
+      joint.ntrack = 0;
+      for (size_t k : bones) {
+        if (frame_offsets[k + 1] - frame_offsets[k] > 2) {
+          joint_frame[k] = 1;
+          joint.ntrack++;
+        }
+      }
+      for (size_t k : morphs) {
+        if (morph_offsets[k + 1] - morph_offsets[k] > 2) {
+          joint_morph[k] = 1;
+          joint.ntrack++;
+        }
+      }
+      for (size_t s = 0; s < frame_segments.size(); s++) {
+        if (!frame_segments[s].copy && find(bones.begin(), bones.end(), frame_segments[s].track) != bones.end()) {
+          joint.bones.push_back(s);
+        }
+      }
+      for (size_t s = 0; s < morph_segments.size(); s++) {
+        if (!morph_segments[s].copy && find(morphs.begin(), morphs.end(), morph_segments[s].track) != morphs.end()) {
+          joint.morphs.push_back(s);
+        }
+      }
+      if (joint.ntrack > 0) {
+        joints.push_back(joint);
+      }
+    }
   }
-  // モーフごとに平滑化と間引きを行い、vmdの表情キーフレームを入れ替える
-  vmd.morph.clear();
-  for (auto iter = morph_map.begin(); iter != morph_map.end(); iter++) {
-    vector<VMD_Morph>& mv = iter->second;
-    if (mv.size() > 2) {
-      smooth_morph_frame(mv, cutoff_freq);
-      if (srcfps != tgtfps) {
-        mv = change_fps_morph(mv, srcfps, tgtfps);
+
+  SearchSegments search;
+  if (search_target) {
+    // 区間ごとのジョブは平滑化して間引きの階層を求めるところまで行う
+    fill(joint_frame.begin(), joint_frame.end(), 1);
+    fill(joint_morph.begin(), joint_morph.end(), 1);
+    search.bones.resize(frame_segments.size());
+    search.bone_hierarchy.resize(frame_segments.size());
+    search.bezier.resize(frame_segments.size());
+    search.morphs.resize(morph_segments.size());
+    search.morph_significance.resize(morph_segments.size());
+    for (size_t s = 0; s < frame_segments.size(); s++) {
+      if (frame_segments[s].copy) {
+        continue;
+      }
+      jobs.push_back(make_pair(frame_segments[s].tail - frame_segments[s].head, [&, s]() {
+            const Segment& seg = frame_segments[s];
+            unique_ptr<TrackWork> work = works.acquire();
+            const SmoothReduceParam& p = frame_params[seg.track];
+            search.bezier[s] = p.bezier;
+            smooth_bone_segment(vmd.frame.data() + seg.head, vmd.frame.data() + seg.tail, seg.start, p, *work);
+            collapse_bone_track(work->bone[0], p, search_min_scale, search.bones[s]);
+            if (report) {
+              smoothed.bones[s].swap(work->bone[0]);
+            }
+            works.release(move(work));
+            build_bone_hierarchy(search.bones[s], p.threshold_pos, p.threshold_rot, p.bezier,
+                                 search_min_scale, search.bone_hierarchy[s], &pool, p.metric,
+                                 p.world_points);
+          }));
+    }
+    for (size_t s = 0; s < morph_segments.size(); s++) {
+      if (morph_segments[s].copy) {
+        continue;
       }
-      mv = reduce_morph_frame(mv, 0, mv.size() - 1, threshold_morph);
+      jobs.push_back(make_pair(morph_segments[s].tail - morph_segments[s].head, [&, s]() {
+            const Segment& seg = morph_segments[s];
+            unique_ptr<TrackWork> work = works.acquire();
+            const SmoothReduceParam& p = morph_params[seg.track];
+            smooth_morph_segment(vmd.morph.data() + seg.head, vmd.morph.data() + seg.tail, seg.start, p, *work);
+            collapse_morph_track(work->morph[0], p, search_min_scale, search.morphs[s]);
+            if (report) {
+              smoothed.morphs[s].swap(work->morph[0]);
+            }
+            works.release(move(work));
+            build_morph_hierarchy(search.morphs[s], p.threshold_morph, search_min_scale, search.morph_significance[s], &pool,
+                                  p.metric);
+          }));
     }
-    for (unsigned int i = 0; i < mv.size(); i++) {
-      vmd.morph.push_back(mv[i]);
+  }
+  make_segment_jobs(vmd.frame, frame_segments, joint_frame,
+                    [&](size_t s, const VMD_Frame* first, const VMD_Frame* last, uint32_t start, int max_keys,
+                        vector<vector<VMD_Frame>>& outs) {
+                      unique_ptr<TrackWork> work = works.acquire();
+                      process_bone_segment(first, last, start, max_keys, frame_params[frame_segments[s].track], *work, &pool, outs);
+                      if (report) {
+                        smoothed.bones[s].swap(work->bone[0]);
+                      }
+                      works.release(move(work));
+                    }, frame_results, jobs);
+  make_segment_jobs(vmd.morph, morph_segments, joint_morph,
+                    [&](size_t s, const VMD_Morph* first, const VMD_Morph* last, uint32_t start, int max_keys,
+                        vector<vector<VMD_Morph>>& outs) {
+                      unique_ptr<TrackWork> work = works.acquire();
+                      process_morph_segment(first, last, start, max_keys, morph_params[morph_segments[s].track], *work, &pool, outs);
+                      if (report) {
+                        smoothed.morphs[s].swap(work->morph[0]);
+                      }
+                      works.release(move(work));
+                    }, morph_results, jobs);
+  for (const JointSegments& joint : joints) {
+    size_t size = 0;
+    for (size_t s : joint.bones) {
+      size += frame_segments[s].tail - frame_segments[s].head;
+    }
+    for (size_t s : joint.morphs) {
+      size += morph_segments[s].tail - morph_segments[s].head;
     }
+    jobs.push_back(make_pair(size, [&]() {
+          unique_ptr<TrackWork> work = works.acquire();
+          process_joint_segments(vmd.frame, frame_segments, vmd.morph, morph_segments, joint, param, *work, &pool,
+                                 frame_results, morph_results, report ? &smoothed : nullptr);
+          works.release(move(work));
+        }));
+  }
+
+  stable_sort(jobs.begin(), jobs.end(),
+              [](const pair<size_t, function<void()>>& a, const pair<size_t, function<void()>>& b) {
+                return a.first > b.first;
+              });
+  for (auto& job : jobs) {
+    pool.submit(group, move(job.second));
   }
+  pool.wait(group);
+  if (search_target) {
+    reduce_to_target(frame_segments, morph_segments, vmd.frame, vmd.morph, param, search, frame_results, morph_results);
+  }
+  if (report) {
+    // 間引いた結果を補間して、間引く前の各フレームとの誤差をトラックごとに並列に求める
+    report->assign(frame_names.size() + morph_names.size(), TrackReport());
+    report_tracks(frame_segments, frame_names, frame_params, smoothed.bones, frame_results, true,
+                  [](const vector<VMD_Frame>& v, const vector<VMD_Frame>& keys, const SmoothReduceParam& p,
+                     array<vector<float>, 2>& errs) {
+                    bone_reconstruction_error(v, keys, p.bezier, errs[0], errs[1]);
+                  }, 0, pool, *report);
+    report_tracks(morph_segments, morph_names, morph_params, smoothed.morphs, morph_results, false,
+                  [](const vector<VMD_Morph>& v, const vector<VMD_Morph>& keys, const SmoothReduceParam&,
+                     array<vector<float>, 2>& errs) {
+                    morph_reconstruction_error(v, keys, errs[0]);
+                  }, frame_names.size(), pool, *report);
+  }
+
+  // 結果を名前順(同じ名前の中では区間順)に連結して、vmdのキーフレームを入れ替える(スレッド数によらず同じ順序になる)
+  level_vmds.resize(param.levels.size());
+  for (size_t k = 0; k < param.levels.size(); k++) {
+    level_vmds[k].header = vmd.header;
+    concat_tracks(level_vmds[k].frame, frame_results, k + 1);
+    concat_tracks(level_vmds[k].morph, morph_results, k + 1);
+    cout << "level " << param.levels[k] << ": frame " << level_vmds[k].frame.size()
+         << ", morph " << level_vmds[k].morph.size() << endl;
+  }
+  concat_tracks(vmd.frame, frame_results, 0);
+  cout << "vmd.frame.size(reduced): " << vmd.frame.size() << endl;
+  concat_tracks(vmd.morph, morph_results, 0);
   cout << "vmd.morph.size(reduced) : " << vmd.morph.size() << endl;
   
   return true;
 }
+
+// VMDモーションの平滑化および間引きを行う
+// param.levelsが指定されていれば、閾値をlevels[k]倍して間引いたものをlevel_vmds[k]に入れる
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param, vector<VMD>& level_vmds)
+{
+  return smooth_and_reduce_tracks(vmd, param, level_vmds, nullptr);
+}
+
+// VMDモーションの平滑化および間引きを行い、トラックごとの間引いた結果をreportに入れる
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param, vector<VMD>& level_vmds, vector<TrackReport>& report)
+{
+  return smooth_and_reduce_tracks(vmd, param, level_vmds, &report);
+}
+
+// VMDモーションの平滑化および間引きを行う
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param)
+{
+  vector<VMD> level_vmds;
+  return smooth_and_reduce(vmd, param, level_vmds);
+}
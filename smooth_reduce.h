@@ -4,10 +4,48 @@
 #ifndef SMOOTH_REDUCE_H
 #define SMOOTH_REDUCE_H
 
+#include <map>
+#include <string>
+#include <vector>
 #include "VMD.h"
+#include "lowpass.h"
+#include "reduce_report.h"
+#include "track_policy.h"
+
+// VMDモーションの平滑化および間引きのパラメータ
+struct SmoothReduceParam {
+  float despike = 0.0;                 // 平滑化の前に除くスパイクの閾値(移動中央値からのずれが標準偏差の何倍か)。0なら除かない
+  float cutoff_freq = 5.0;             // カットオフ周波数[Hz]。0以下の場合は平滑化しない
+  FilterType filter = FilterType::FFT; // ローパスフィルタの種類
+  float threshold_pos = 0.2;           // 位置の間引きの閾値。負の場合は間引かない
+  float threshold_rot = 3.0;           // 回転の間引きの閾値[degree]。負の場合は間引かない
+  float threshold_morph = 0.1;         // 表情の間引きの閾値(0～1)。負の場合は間引かない
+  vector<float> levels;                // 閾値をそれぞれ何倍かにして間引いたものも出力する(間引きの階層を1回だけ求めて使う)
+  int max_keys = 0;                    // トラックごとのキーフレーム数の上限(0か2以上)。levelsの出力にも適用する。0なら閾値だけで間引く
+  float srcfps = 30.0;                 // 入力のフレームレート
+  float tgtfps = 30.0;                 // 出力のフレームレート
+  bool decimate_first = false;         // 先にフレームレートを変えてから平滑化するか(入力の方が高いときは折り返し防止のフィルタをかける)
+  bool bezier = false;                 // ボーンの補間曲線を最適化するか
+  int max_gap = 0;                     // これより長く(入力のフレーム数)キーフレームがない所でトラックを分ける。0なら分けない
+  int num_threads = 0;                 // トラックを並列に処理するスレッド数。0ならCPUのスレッド数
+  vector<vector<std::string>> joint_groups; // 一緒に間引くトラックの組(UTF-8の名前)。組の中ではキーフレームを同じフレームに置く
+                                            // (閾値だけで間引くときに使い、levelsやmax_keysを指定したときは使わない)
+  ErrorMetric metric = ErrorMetric::Max; // 区間の誤差の測り方
+  std::map<std::string, TrackPolicy> policies; // トラック名(UTF-8、nameconfで変える前の名前)ごとの間引きの設定。
+                                               // 閾値、補間曲線、誤差の測り方を上の設定の代わりに使う(joint_groupsには入れない)
+  vector<Vector3f> world_points;       // 回転の誤差を測るボーンのローカル座標の点(policiesで指定する)。空なら回転の角度で測る
+  float target_kps = 0.0;              // トラックあたり毎秒のキーフレーム数の目標。正ならボーンと表情それぞれで閾値の倍率を探す
+                                       // (levelsやmax_keysを指定したときは使わない。指定したときはjoint_groupsを使わない)
+};
+
+// VMDモーションの平滑化および間引きを行う
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param);
 
 // VMDモーションの平滑化および間引きを行う
-bool smooth_and_reduce(VMD& vmd, float cutoff_freq, float threshold_pos, float threshold_rot,
-                       float threshold_morph, float srcfps, float tgtfps, bool bezier);
+// param.levelsが指定されていれば、閾値をlevels[k]倍して間引いたものをlevel_vmds[k]に入れる
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param, vector<VMD>& level_vmds);
+
+// VMDモーションの平滑化および間引きを行い、トラックごとの間引いた結果(メインの出力を平滑化した後の各フレームと比べた誤差)をreportに入れる
+bool smooth_and_reduce(VMD& vmd, const SmoothReduceParam& param, vector<VMD>& level_vmds, vector<TrackReport>& report);
 
 #endif // ifndef SMOOTH_REDUCE_H
@@ -1,13 +1,15 @@
 // VMDモーションを平滑化する
 
+#include <algorithm>
+#include <cmath>
 #include <map>
 #include <string>
 #include <vector>
 #include <Eigen/Core>
-#include <unsupported/Eigen/FFT>
 #include "VMD.h"
 #include "MMDFileIOUtil.h"
 #include "interpolate.h"
+#include "lowpass.h"
 #include "reducevmd.h"
 #include "smoothvmd.h"
 
@@ -15,122 +17,282 @@ using namespace Eigen;
 using namespace MMDFileIOUtil;
 using namespace std;
 
-// ローパスフィルタ。cutoff_freqより高い周波数成分を除去する
-void lowpass_filter(vector<float>& v, float cutoff_freq)
+// 中心からhalf個ずつ前後のデータの平均(移動平均)をdstに求める。両端では範囲内のデータだけで平均する
+static void moving_average(const float* src, float* dst, int n, int half)
 {
-  if (v.size() < 2) {
+  double sum = 0;
+  double head = 0;
+  int lo = 0;
+  int hi = 0;
+  for (int i = 0; i < n; i++) {
+    // [i - half, i + half] の和を尺取りで求める
+    while (hi < n && hi <= i + half) {
+      sum += src[hi++];
+    }
+    while (lo < i - half) {
+      head += src[lo++];
+    }
+    dst[i] = (sum - head) / (hi - lo);
+  }
+}
+
+// 2つのクォータニオン(配列)の積 a * b を求める。conj_aがtrueならaの共役を使う
+typedef const Ref<const ArrayXf>& ArrayArg;
+static void quaternion_product(ArrayArg aw, ArrayArg ax, ArrayArg ay, ArrayArg az,
+                               ArrayArg bw, ArrayArg bx, ArrayArg by, ArrayArg bz,
+                               float* w, float* x, float* y, float* z, bool conj_a = false)
+{
+  int n = aw.size();
+  float s = conj_a ? -1 : 1;
+  Map<ArrayXf>(w, n) = aw * bw - (s * ax) * bx - (s * ay) * by - (s * az) * bz;
+  Map<ArrayXf>(x, n) = aw * bx + (s * ax) * bw + (s * ay) * bz - (s * az) * by;
+  Map<ArrayXf>(y, n) = aw * by - (s * ax) * bz + (s * ay) * bw + (s * az) * bx;
+  Map<ArrayXf>(z, n) = aw * bz + (s * ax) * by - (s * ay) * bx + (s * az) * bw;
+}
+
+// 外れ値とみなす中央値の窓(前後それぞれ)。これ以下の長さのスパイクが除去される
+// まばたきのような3フレーム以上の動きは残る
+static const int despike_half = 2;
+// ばらつきの大きさを求める窓(前後それぞれ)。短い窓のMADはばらつきが大きく、正常な値まで外れ値としてしまうので長めにとる
+static const int despike_scale_half = 15;
+
+// 外れ値の判定に使う標準偏差の下限(成分の種類ごと)。ほとんど一定のトラック(0に張り付いたモーフなど)ではMADが0になり、
+// わずかな動きまで外れ値とされてしまうので、それぞれの値の大きさに対して十分小さい値で下から抑える
+static const float despike_min_sigma_pos = 0.02;    // 位置(モデルの長さの単位)
+static const float despike_min_sigma_rot = 0.005;   // クォータニオンの要素(約0.6度)
+static const float despike_min_sigma_morph = 0.02;  // 表情の値(0～1)
+
+// 区間[lo, hi]の中央値を求める。winは作業領域
+static float window_median(const float* x, int lo, int hi, float* win)
+{
+  int w = hi - lo + 1;
+  copy(x + lo, x + hi + 1, win);
+  nth_element(win, win + w / 2, win + w);
+  return win[w / 2];
+}
+
+// 移動中央値による外れ値の検出(Hampelフィルタ)
+// x[i]と前後despike_half個ずつの中央値med[i]との差が、その差の前後despike_scale_half個の中央値(MAD)から求めた
+// 標準偏差(min_sigma以上にする)のnsigma倍を超えたら、外れ値としてspike[i]を1にする
+// devは長さnの、winは長さ2*despike_scale_half+1の作業領域
+static void hampel(const float* x, int n, float nsigma, float min_sigma, float* med, float* dev, uint8_t* spike, float* win)
+{
+  for (int i = 0; i < n; i++) {
+    med[i] = window_median(x, max(0, i - despike_half), min(n - 1, i + despike_half), win);
+    dev[i] = fabs(x[i] - med[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    float mad = window_median(dev, max(0, i - despike_scale_half), min(n - 1, i + despike_scale_half), win);
+    float sigma = max(1.4826f * mad, min_sigma); // 正規分布ならMADの1.4826倍が標準偏差になる
+    spike[i] = (dev[i] > nsigma * sigma) ? 1 : 0;
+  }
+}
+
+// ボーンキーフレーム列fvから、1～2フレームだけ跳ねるトラッキングの誤りを取り除く
+// 位置の各軸と、符号を揃えたクォータニオンの各要素ごとに移動中央値から外れたフレームを探し、
+// 中央値で置き換える(回転はどれか1つの要素が外れていたら、4要素の中央値を正規化したものにする)
+void despike_bone_frame(vector<VMD_Frame>& fv, LowpassFilter& filter, float nsigma)
+{
+  int n = fv.size();
+  if (nsigma <= 0 || n <= 2 * despike_half) {
     return;
   }
-  FFT<float> fft;
-  vector<complex<float>> freqvec;
-  fft.fwd(freqvec, v);
-
-  // フィルタリング
-  const float sampling_freq = 30.0; // サンプリング周波数[Hz]。MMDは30FPSなので。
-  int data_size = v.size();
-  int cutoff_idx;
-  // 打ち切る位置(cutoff_idx)を求める： cutoff_idx / data_size = cutoff_freq / sampling_freq
-  cutoff_idx = cutoff_freq * data_size / sampling_freq;
-  
-  vector<complex<float>> filtered(data_size);
-  for (int i = 0; i < data_size; i++) {
-    if (i < cutoff_idx) {
-      filtered[i] = freqvec[i];
-    } else {
-      filtered[i] = 0.0;
+  float* x[7];   // 位置(x, y, z)とクォータニオン(w, x, y, z)
+  float* med[7]; // 中央値
+  for (int c = 0; c < 7; c++) {
+    x[c] = filter.scratch(c, n);
+    med[c] = filter.scratch(7 + c, n);
+  }
+  float* dev = filter.scratch(14, n);
+  float* win = filter.scratch(15, 2 * despike_scale_half + 1);
+  vector<uint8_t> spike(7 * n); // 外れ値かどうか
+
+  Quaternionf prev = fv[0].rotation;
+  for (int i = 0; i < n; i++) {
+    Quaternionf r = fv[i].rotation;
+    if (r.dot(prev) < 0) {
+      r.coeffs() *= -1;
+    }
+    prev = r;
+    x[0][i] = fv[i].position.x();
+    x[1][i] = fv[i].position.y();
+    x[2][i] = fv[i].position.z();
+    x[3][i] = r.w();
+    x[4][i] = r.x();
+    x[5][i] = r.y();
+    x[6][i] = r.z();
+  }
+  for (int c = 0; c < 7; c++) {
+    hampel(x[c], n, nsigma, (c < 3) ? despike_min_sigma_pos : despike_min_sigma_rot, med[c], dev, &spike[c * n], win);
+  }
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      if (spike[c * n + i]) {
+        fv[i].position[c] = med[c][i];
+      }
+    }
+    if (spike[3 * n + i] || spike[4 * n + i] || spike[5 * n + i] || spike[6 * n + i]) {
+      fv[i].rotation = Quaternionf(med[3][i], med[4][i], med[5][i], med[6][i]).normalized();
     }
   }
-  fft.inv(v, filtered);
 }
 
-// ボーンキーフレーム列fvの値を平滑化する
-// 引数fvには同一ボーンのキーフレームがフレーム番号順に格納されているものとする
-void smooth_bone_frame(vector<VMD_Frame>& fv, float cutoff_freq, bool bezier)
+// 表情キーフレーム列mvから、1～2フレームだけ跳ねる誤りを移動中央値で取り除く
+void despike_morph_frame(vector<VMD_Morph>& mv, LowpassFilter& filter, float nsigma)
 {
-  sort(fv.begin(), fv.end());
-  fv = fill_bone_frame(fv, bezier); // キーフレームの隙間をなくす
-  if (cutoff_freq < 0) {
+  int n = mv.size();
+  if (nsigma <= 0 || n <= 2 * despike_half) {
     return;
   }
-  
-  // ローパスフィルタにかける
-  vector<float> x;
-  for_each(fv.begin(), fv.end(), [&x](VMD_Frame f) { x.push_back(f.position.x()); });
-  lowpass_filter(x, cutoff_freq);
-  for (unsigned int i = 0; i < x.size(); i++) {
-    fv[i].position.x() = x[i];
-  }
-  vector<float> y;
-  for_each(fv.begin(), fv.end(), [&y](VMD_Frame f) { y.push_back(f.position.y()); });
-  lowpass_filter(y, cutoff_freq);
-  for (unsigned int i = 0; i < y.size(); i++) {
-    fv[i].position.y() = y[i];
-  }
-  vector<float> z;
-  for_each(fv.begin(), fv.end(), [&z](VMD_Frame f) { z.push_back(f.position.z()); });
-  lowpass_filter(z, cutoff_freq);
-  for (unsigned int i = 0; i < z.size(); i++) {
-    fv[i].position.z() = z[i];
-  }
-
-  // 回転のローパスフィルタ
-  // ※正しいやり方が分からないため、クォータニオンの各要素に対してローパスフィルタを掛けている。
-  // TODO: クォータニオンのフーリエ変換
-  // 同じ回転を表すクォータニオンが正負2通りあるので、wの符号が正のほうに統一する
-  for (unsigned int i = 0; i < fv.size(); i++) {
-    if (fv[i].rotation.w() < 0) {
-      fv[i].rotation.w() *= -1;
-      fv[i].rotation.x() *= -1;
-      fv[i].rotation.y() *= -1;
-      fv[i].rotation.z() *= -1;
+  float* w = filter.scratch(0, n);
+  float* med = filter.scratch(1, n);
+  float* dev = filter.scratch(2, n);
+  float* win = filter.scratch(3, 2 * despike_scale_half + 1);
+  vector<uint8_t> spike(n);
+  for (int i = 0; i < n; i++) {
+    w[i] = mv[i].weight;
+  }
+  hampel(w, n, nsigma, despike_min_sigma_morph, med, dev, spike.data(), win);
+  for (int i = 0; i < n; i++) {
+    if (spike[i]) {
+      mv[i].weight = med[i];
+    }
+  }
+}
+
+// 移動平均の姿勢を正規化するときの、平均したクォータニオンの大きさの下限
+// 符号の違うクォータニオンが打ち消し合ってこれより小さくなったら、向きが定まらないので使わない
+static const float min_mean_norm = 1.0e-3;
+
+// ボーンキーフレーム列fvの値をその場で平滑化する
+// 引数fvには同一ボーンのキーフレームが隙間なく(fill_bone_frameで埋めて)格納されているものとする
+// 作業領域はfilterのものを使うので、トラックごとのメモリ確保はない
+void smooth_bone_frame(vector<VMD_Frame>& fv, LowpassFilter& filter)
+{
+  if (filter.cutoff_freq <= 0) {
+    // カットオフ周波数が0以下ならフィルタを設計できない(移動平均の幅も決まらない)ので平滑化しない
+    return;
+  }
+
+  // 回転は、クォータニオンの各要素に独立にフィルタを掛けると正規化で歪むうえ、
+  // wの符号を揃えると180度を超えたところで符号が反転して大きく跳ぶ。
+  // そこで、符号を前のフレームと連続になるように揃えてから移動平均の姿勢を求め、
+  // 移動平均からのずれを対数写像で3次元の回転ベクトルにしてフィルタを掛け、指数写像で戻す。
+  int n = fv.size();
+  float* ch[6]; // 位置(x, y, z)と回転ベクトル(x, y, z)
+  for (int c = 0; c < 6; c++) {
+    ch[c] = filter.scratch(c, n);
+  }
+  float* q[4];   // 符号を揃えたクォータニオン(w, x, y, z)
+  float* ref[4]; // 移動平均の姿勢(w, x, y, z)
+  for (int c = 0; c < 4; c++) {
+    q[c] = filter.scratch(6 + c, n);
+    ref[c] = filter.scratch(10 + c, n);
+  }
+  float* tmp = filter.scratch(14, n);
+  float* tmp2 = filter.scratch(15, n);
+  float* v[3]; // 指数写像で戻した回転(x, y, z)
+  for (int c = 0; c < 3; c++) {
+    v[c] = filter.scratch(16 + c, n);
+  }
+
+  Quaternionf prev = fv[0].rotation;
+  for (int i = 0; i < n; i++) {
+    ch[0][i] = fv[i].position.x();
+    ch[1][i] = fv[i].position.y();
+    ch[2][i] = fv[i].position.z();
+    Quaternionf r = fv[i].rotation;
+    if (r.dot(prev) < 0) {
+      r.coeffs() *= -1;
     }
+    q[0][i] = r.w();
+    q[1][i] = r.x();
+    q[2][i] = r.y();
+    q[3][i] = r.z();
+    prev = r;
   }
-  vector<float> rx;
-  for_each(fv.begin(), fv.end(), [&rx](VMD_Frame f) { rx.push_back(f.rotation.x()); });
-  lowpass_filter(rx, cutoff_freq);
-  for (unsigned int i = 0; i < rx.size(); i++) {
-    fv[i].rotation.x() = rx[i];
-  }
-  vector<float> ry;
-  for_each(fv.begin(), fv.end(), [&ry](VMD_Frame f) { ry.push_back(f.rotation.y()); });
-  lowpass_filter(ry, cutoff_freq);
-  for (unsigned int i = 0; i < ry.size(); i++) {
-    fv[i].rotation.y() = ry[i];
-  }
-  vector<float> rz;
-  for_each(fv.begin(), fv.end(), [&rz](VMD_Frame f) { rz.push_back(f.rotation.z()); });
-  lowpass_filter(rz, cutoff_freq);
-  for (unsigned int i = 0; i < rz.size(); i++) {
-    fv[i].rotation.z() = rz[i];
-  }
-  vector<float> rw;
-  for_each(fv.begin(), fv.end(), [&rw](VMD_Frame f) { rw.push_back(f.rotation.w()); });
-  lowpass_filter(rw, cutoff_freq);
-  for (unsigned int i = 0; i < rw.size(); i++) {
-    fv[i].rotation.w() = rw[i];
-  }
-  // 各要素(w, x, y, z)に対し独立に変換をかけているので、正規化しておく
-  // （正規化しないと、回転した先の部分が歪む）
-  for (unsigned int i = 0; i < fv.size(); i++) {
+
+  // 幅がカットオフ周期の約2倍の移動平均を2回かけて(三角窓)、正規化する。
+  // 移動平均で除去しきれない高い周波数の成分は、ずれの側に残ってフィルタで除去される。
+  int half = max(1, int(filter.sampling_freq / filter.cutoff_freq));
+  for (int c = 0; c < 4; c++) {
+    moving_average(q[c], tmp, n, half);
+    moving_average(tmp, ref[c], n, half);
+  }
+  Map<ArrayXf> qw(q[0], n), qx(q[1], n), qy(q[2], n), qz(q[3], n);
+  Map<ArrayXf> rw(ref[0], n), rx(ref[1], n), ry(ref[2], n), rz(ref[3], n);
+  Map<ArrayXf> norm(tmp2, n);
+  norm = (rw.square() + rx.square() + ry.square() + rz.square()).sqrt();
+  // 平均がほぼ0になったフレームは正規化できないので、前のフレームの移動平均の姿勢(先頭ならそのフレームの姿勢)にする
+  for (int i = 0; i < n; i++) {
+    if (norm[i] >= min_mean_norm) {
+      rw[i] /= norm[i];
+      rx[i] /= norm[i];
+      ry[i] /= norm[i];
+      rz[i] /= norm[i];
+    } else if (i > 0) {
+      rw[i] = rw[i - 1];
+      rx[i] = rx[i - 1];
+      ry[i] = ry[i - 1];
+      rz[i] = rz[i - 1];
+    } else {
+      rw[i] = qw[i];
+      rx[i] = qx[i];
+      ry[i] = qy[i];
+      rz[i] = qz[i];
+    }
+  }
+
+  // 移動平均からのずれ d = conj(ref) * q を対数写像で回転ベクトルにする
+  quaternion_product(rw, rx, ry, rz, qw, qx, qy, qz, tmp, ch[3], ch[4], ch[5], true);
+  for (int i = 0; i < n; i++) {
+    float w = tmp[i];
+    float sign = (w < 0) ? -1 : 1;
+    float s = sqrt(ch[3][i] * ch[3][i] + ch[4][i] * ch[4][i] + ch[5][i] * ch[5][i]);
+    float k = (s > 1.0e-7) ? sign * atan2(s, sign * w) / s : 1.0f;
+    ch[3][i] *= k;
+    ch[4][i] *= k;
+    ch[5][i] *= k;
+  }
+
+  filter.apply(ch, 6, n);
+
+  // 指数写像で戻し、移動平均の姿勢に掛ける
+  Map<ArrayXf> vx(ch[3], n), vy(ch[4], n), vz(ch[5], n);
+  Map<ArrayXf> theta(tmp, n), ew(tmp2, n);
+  theta = (vx.square() + vy.square() + vz.square()).sqrt();
+  ew = theta.cos();
+  theta = (theta > 1.0e-7).select(theta.sin() / theta, 1.0f); // sin(θ)/θ
+  Map<ArrayXf>(v[0], n) = vx * theta;
+  Map<ArrayXf>(v[1], n) = vy * theta;
+  Map<ArrayXf>(v[2], n) = vz * theta;
+  quaternion_product(rw, rx, ry, rz, ew, Map<ArrayXf>(v[0], n), Map<ArrayXf>(v[1], n), Map<ArrayXf>(v[2], n),
+                     q[0], q[1], q[2], q[3]);
+
+  for (int i = 0; i < n; i++) {
+    fv[i].position = Vector3f(ch[0][i], ch[1][i], ch[2][i]);
+    fv[i].rotation = Quaternionf(q[0][i], q[1][i], q[2][i], q[3][i]);
     fv[i].rotation.normalize();
   }
 }
 
-// 表情キーフレーム列mvの値を平滑化する
-// 引数mvには同一モーフのキーフレームがフレーム番号順に格納されているものとする
-void smooth_morph_frame(vector<VMD_Morph>& mv, float cutoff_freq)
+// 表情キーフレーム列mvの値をその場で平滑化する
+// 引数mvには同一モーフのキーフレームが隙間なく(fill_morph_frameで埋めて)格納されているものとする
+void smooth_morph_frame(vector<VMD_Morph>& mv, LowpassFilter& filter)
 {
-  sort(mv.begin(), mv.end());
-  mv = fill_morph_frame(mv); // キーフレームの隙間をなくす
-  if (cutoff_freq < 0) {
+  if (filter.cutoff_freq <= 0) {
+    // ボーンと同じく、カットオフ周波数が0以下なら平滑化しない
     return;
   }
-    
+
   // ローパスフィルタにかける
-  vector<float> w;
-  for_each(mv.begin(), mv.end(), [&w](VMD_Morph s) { w.push_back(s.weight); });
-  lowpass_filter(w, cutoff_freq);
-  for (unsigned int i = 0; i < w.size(); i++) {
+  int n = mv.size();
+  float* w = filter.scratch(0, n);
+  for (int i = 0; i < n; i++) {
+    w[i] = mv[i].weight;
+  }
+  filter.apply(&w, 1, n);
+  for (int i = 0; i < n; i++) {
     mv[i].weight = w[i];
     if (w[i] > 1.0) {
       mv[i].weight = 1.0;
@@ -139,4 +301,3 @@ void smooth_morph_frame(vector<VMD_Morph>& mv, float cutoff_freq)
     }
   }
 }
-
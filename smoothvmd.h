@@ -6,11 +6,22 @@
 
 #include <vector>
 #include "VMD.h"
+#include "lowpass.h"
 
-// ボーンキーフレーム列fvの値を平滑化する
-void smooth_bone_frame(vector<VMD_Frame>& fv, float cutoff_freq, bool bezier);
+// ボーンキーフレーム列fvの値をその場で平滑化する
+// fvはフレーム番号に隙間のないもの(fill_bone_frameで埋めたもの)とする
+void smooth_bone_frame(vector<VMD_Frame>& fv, LowpassFilter& filter);
 
-// 表情キーフレーム列mvの値を平滑化する
-void smooth_morph_frame(vector<VMD_Morph>& mv, float cutoff_freq);
+// 表情キーフレーム列mvの値をその場で平滑化する
+// mvはフレーム番号に隙間のないもの(fill_morph_frameで埋めたもの)とする
+void smooth_morph_frame(vector<VMD_Morph>& mv, LowpassFilter& filter);
+
+// ボーンキーフレーム列fvから、移動中央値から大きく外れた1～2フレームのスパイクを取り除く
+// nsigmaは外れ値とみなす中央値からのずれ(中央値絶対偏差から求めた標準偏差の何倍か)。0以下なら何もしない
+// fvはフレーム番号に隙間のないものとする。作業領域はfilterのものを使う
+void despike_bone_frame(vector<VMD_Frame>& fv, LowpassFilter& filter, float nsigma);
+
+// 表情キーフレーム列mvから、移動中央値から大きく外れた1～2フレームのスパイクを取り除く
+void despike_morph_frame(vector<VMD_Morph>& mv, LowpassFilter& filter, float nsigma);
 
 #endif // ifndef SMOOTHVMD_H
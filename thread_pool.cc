@@ -0,0 +1,140 @@
+// ワークスティーリング型のスレッドプール
+
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "thread_pool.h"
+
+using namespace std;
+
+// 現在のスレッドがワーカーとして属するプールとその番号
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local int current_index = -1;
+// 現在のスレッドが実行中のタスクのプール(タスクを実行していなければnullptr)
+static thread_local const ThreadPool* running_pool = nullptr;
+
+ThreadPool::ThreadPool(int num_threads) : queued(0), stop(false)
+{
+  if (num_threads <= 0) {
+    num_threads = max(1u, thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads; i++) {
+    queues.push_back(unique_ptr<Queue>(new Queue));
+  }
+  for (int i = 0; i < num_threads - 1; i++) {
+    workers.push_back(thread(&ThreadPool::worker_loop, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  for (thread& t : workers) {
+    t.join();
+  }
+}
+
+// 現在のスレッドの番号(0～size()-1)。ワーカー以外のスレッドはsize()-1になる
+int ThreadPool::thread_index() const
+{
+  if (current_pool == this) {
+    return current_index;
+  }
+  return size() - 1;
+}
+
+// 現在のスレッドがこのプールのタスクを実行中か
+bool ThreadPool::in_task() const
+{
+  return running_pool == this;
+}
+
+// taskをgroupに属するタスクとして登録する
+void ThreadPool::submit(TaskGroup& group, function<void()> task)
+{
+  group.pending++;
+  Queue& q = *queues[thread_index()];
+  {
+    lock_guard<mutex> lock(q.mtx);
+    q.tasks.push_back(Task{move(task), &group});
+  }
+  {
+    lock_guard<mutex> lock(mtx);
+    queued++;
+  }
+  cv.notify_all();
+}
+
+// タスクを1つ実行する。実行できるタスクがなければfalseを返す
+// 自分のキューからは最後に登録したものを取り(キャッシュに残っているデータを使うため)、
+// 他のスレッドのキューからは最初に登録したもの(大きな仕事であることが多い)を盗む
+bool ThreadPool::run_one(int self)
+{
+  Task task;
+  bool found = false;
+  int n = queues.size();
+  for (int k = 0; k < n && !found; k++) {
+    Queue& q = *queues[(self + k) % n];
+    lock_guard<mutex> lock(q.mtx);
+    if (q.tasks.empty()) {
+      continue;
+    }
+    if (k == 0) {
+      task = move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      task = move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+    found = true;
+  }
+  if (!found) {
+    return false;
+  }
+  queued--;
+  // タスクの中で待つと別のタスクを入れ子に実行するので、終わったら元に戻す
+  const ThreadPool* outer = running_pool;
+  running_pool = this;
+  task.func();
+  running_pool = outer;
+  if (--task.group->pending == 0) {
+    // 待っているスレッドを起こす
+    lock_guard<mutex> lock(mtx);
+    cv.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::worker_loop(int self)
+{
+  current_pool = this;
+  current_index = self;
+  for (;;) {
+    if (run_one(self)) {
+      continue;
+    }
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this] { return stop || queued > 0; });
+    if (stop) {
+      return;
+    }
+  }
+}
+
+// groupのタスクが全て終わるまで待つ。待っている間は呼び出し元のスレッドもタスクを実行する
+void ThreadPool::wait(TaskGroup& group)
+{
+  int self = thread_index();
+  while (group.pending > 0) {
+    if (run_one(self)) {
+      continue;
+    }
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this, &group] { return group.pending == 0 || queued > 0; });
+  }
+}
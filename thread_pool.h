@@ -0,0 +1,72 @@
+// -*- C++ -*-
+// ワークスティーリング型のスレッドプール
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// まとめて完了を待つタスクの集まり
+class TaskGroup {
+public:
+  TaskGroup() : pending(0) { }
+private:
+  std::atomic<int> pending; // 終わっていないタスクの数
+  friend class ThreadPool;
+};
+
+// スレッドごとにタスクのキューを持ち、自分のキューが空になったら他のスレッドのキューから盗んで実行する。
+// タスクの中から新しいタスクを登録して待つこともできる(待っている間は他のタスクを実行する)。
+class ThreadPool {
+public:
+  // num_threadsは呼び出し元のスレッドを含めたスレッド数。0以下ならCPUのスレッド数にする
+  explicit ThreadPool(int num_threads = 0);
+  ~ThreadPool();
+
+  // taskをgroupに属するタスクとして登録する
+  void submit(TaskGroup& group, std::function<void()> task);
+
+  // groupのタスクが全て終わるまで待つ。待っている間は呼び出し元のスレッドもタスクを実行する
+  void wait(TaskGroup& group);
+
+  // 呼び出し元を含めたスレッド数
+  int size() const { return workers.size() + 1; }
+
+  // 現在のスレッドの番号(0～size()-1)。ワーカー以外のスレッドはsize()-1になる
+  // スレッドごとの作業領域を使い分けるのに使う。ただしタスクの中で待つと、待っている間に同じスレッドで
+  // 別のタスクが動くので、待つタスクの作業領域には使えない
+  int thread_index() const;
+
+  // 現在のスレッドがこのプールのタスクを実行中か(ワーカーでも、waitの間にタスクを実行する呼び出し元でもよい)
+  // タスクの中では他のスレッドも別のタスクを実行しているので、小さな仕事をさらにタスクに分けても速くならない
+  bool in_task() const;
+
+private:
+  struct Task {
+    std::function<void()> func;
+    TaskGroup* group;
+  };
+  struct Queue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  bool run_one(int self);
+  void worker_loop(int self);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<Queue>> queues; // スレッドごとのキュー。最後は呼び出し元のスレッド用
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::atomic<int> queued; // キューに入っているタスクの数
+  bool stop;
+};
+
+#endif // ifndef THREAD_POOL_H
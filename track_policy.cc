@@ -0,0 +1,100 @@
+// トラックごとの間引きの設定
+
+#include <boost/algorithm/string.hpp>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "track_policy.h"
+
+using namespace std;
+
+// 設定ファイルに書かれた名前(nameconfで変えた後の名前)に対応する、元のトラック名を返す
+static vector<string> original_names(const string& name, const map<string, string>& rename_map)
+{
+  vector<string> names;
+  for (const auto& r : rename_map) {
+    if (r.second == name) {
+      names.push_back(r.first);
+    }
+  }
+  // 名前を変えないトラック
+  if (rename_map.find(name) == rename_map.end()) {
+    names.push_back(name);
+  }
+  return names;
+}
+
+// key=valueを1つpolicyに反映する。解釈できなければfalseを返す
+static bool set_policy(TrackPolicy& policy, const string& key, const string& value)
+{
+  try {
+    if (key == "pos") {
+      policy.threshold_pos = stof(value);
+    } else if (key == "rot") {
+      policy.threshold_rot = stof(value);
+    } else if (key == "morph") {
+      policy.threshold_morph = stof(value);
+    } else if (key == "interp" && (value == "linear" || value == "bezier")) {
+      policy.bezier = (value == "bezier");
+    } else if (key == "metric" && (value == "max" || value == "rms")) {
+      policy.metric = (value == "rms") ? ErrorMetric::RMS : ErrorMetric::Max;
+    } else if (key == "point") {
+      istringstream is(value);
+      Vector3f p;
+      if (!(is >> p.x() >> p.y() >> p.z())) {
+        return false;
+      }
+      policy.world_points.push_back(p);
+    } else {
+      return false;
+    }
+  } catch (exception& e) {
+    return false;
+  }
+  return true;
+}
+
+// 設定ファイルの各行は トラック名,項目=値,項目=値,... の形式
+//   pos, rot, morph: 位置、回転[degree]、表情の間引きの閾値(負なら間引かない)
+//   interp: ボーンの補間曲線(linear, bezier)
+//   metric: 区間の誤差の測り方(max: 最も離れたフレームの誤差, rms: 二乗平均平方根)
+//   point: 回転の誤差を測るボーンのローカル座標の点(x y zを空白で区切る)。複数書ける。書いたときはrotは点のずれの閾値になる
+// 行頭が#で始まる行はコメント。同じトラックを複数の行に書いたときは後の行の項目で上書きする
+map<string, TrackPolicy> make_track_policies(const string& fname_conf, const map<string, string>& rename_map,
+                                             const TrackPolicy& defaults)
+{
+  map<string, TrackPolicy> policies;
+  ifstream conf(fname_conf);
+  if (!conf) {
+    cerr << "policy: cannot open " << fname_conf << endl;
+    return policies;
+  }
+  for (string line; getline(conf, line); ) {
+    boost::algorithm::trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    vector<string> fields;
+    boost::algorithm::split(fields, line, boost::is_any_of(","));
+    for (string& s : fields) {
+      boost::algorithm::trim(s);
+    }
+    for (const string& name : original_names(fields[0], rename_map)) {
+      TrackPolicy& policy = policies.insert(make_pair(name, defaults)).first->second;
+      for (size_t i = 1; i < fields.size(); i++) {
+        size_t sep = fields[i].find('=');
+        string key = fields[i].substr(0, sep);
+        string value = (sep == string::npos) ? "" : fields[i].substr(sep + 1);
+        boost::algorithm::trim(key);
+        boost::algorithm::trim(value);
+        if (!set_policy(policy, key, value)) {
+          cerr << "policy: invalid item: " << line << endl;
+        }
+      }
+    }
+  }
+  return policies;
+}
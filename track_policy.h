@@ -0,0 +1,28 @@
+// -*- C++ -*-
+// トラックごとの間引きの設定
+
+#ifndef TRACK_POLICY_H
+#define TRACK_POLICY_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "reducevmd.h"
+
+// 1つのトラックの間引きの設定
+struct TrackPolicy {
+  float threshold_pos;   // 位置の間引きの閾値。負の場合は間引かない
+  float threshold_rot;   // 回転の間引きの閾値[degree]。負の場合は間引かない
+  float threshold_morph; // 表情の間引きの閾値。負の場合は間引かない
+  bool bezier;           // ボーンの補間曲線を最適化するか
+  ErrorMetric metric;    // 区間の誤差の測り方
+  vector<Vector3f> world_points; // 回転の誤差を測るボーンのローカル座標の点。空でなければthreshold_rotは点のずれ(モデルの長さの単位)
+};
+
+// 設定ファイルfname_confから、トラック名(nameconfで変える前のUTF-8の名前)ごとの間引きの設定を作る
+// 設定ファイルの名前はnameconfで変えた後のものなので、rename_mapで元の名前に戻す。指定しなかった項目はdefaultsと同じにする
+std::map<std::string, TrackPolicy> make_track_policies(const std::string& fname_conf,
+                                                       const std::map<std::string, std::string>& rename_map,
+                                                       const TrackPolicy& defaults);
+
+#endif // ifndef TRACK_POLICY_H